@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <iostream>
 #include <fstream>
+#define GL_GLEXT_PROTOTYPES
 #include <GL/glut.h>
 #include <limits.h>
 #include <assert.h>
@@ -8,6 +9,63 @@
 #include <math.h>
 #include <vector>
 #include <float.h>
+#include <algorithm>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <string>
+#include <functional>
+#include <chrono>
+#include <random>
+
+// Batched height queries test several triangles per instruction. Build with
+// -mavx2 to get 8 lanes, otherwise SSE2 gives 4 on any x86-64
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_WIDTH (8)
+#define VF __m256
+#define VLOAD(p) _mm256_loadu_ps(p)
+#define VSTORE(p,a) _mm256_storeu_ps(p,a)
+#define VSET(x) _mm256_set1_ps(x)
+#define VADD(a,b) _mm256_add_ps(a,b)
+#define VMUL(a,b) _mm256_mul_ps(a,b)
+#define VGE(a,b) _mm256_cmp_ps(a,b,_CMP_GE_OQ)
+#define VAND(a,b) _mm256_and_ps(a,b)
+#define VMASK(m) _mm256_movemask_ps(m)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_WIDTH (4)
+#define VF __m128
+#define VLOAD(p) _mm_loadu_ps(p)
+#define VSTORE(p,a) _mm_storeu_ps(p,a)
+#define VSET(x) _mm_set1_ps(x)
+#define VADD(a,b) _mm_add_ps(a,b)
+#define VMUL(a,b) _mm_mul_ps(a,b)
+#define VGE(a,b) _mm_cmpge_ps(a,b)
+#define VAND(a,b) _mm_and_ps(a,b)
+#define VMASK(m) _mm_movemask_ps(m)
+#else
+#define SIMD_WIDTH (1)
+#define VF GLfloat
+#define VLOAD(p) (*(p))
+#define VSTORE(p,a) (*(p) = (a))
+#define VSET(x) (x)
+#define VADD(a,b) ((a) + (b))
+#define VMUL(a,b) ((a) * (b))
+#define VGE(a,b) ((a) >= (b))
+#define VAND(a,b) ((a) && (b))
+#define VMASK(m) ((int)(m))
+#endif
 
 #define INITIAL_WINDOW_SIZE (800)
 
@@ -129,7 +187,7 @@ Vector cross(Vector one, Vector two) {
 
 
 GLfloat dot(Vector one, Vector two) {
-    GLfloat dot = (one.x*two.x) + (one.y*two.y) + (one.z*two.z);
+    return (one.x*two.x) + (one.y*two.y) + (one.z*two.z);
 }
 
 GLfloat lerp(GLfloat one, GLfloat two, GLfloat t) {
@@ -149,281 +207,4520 @@ Point lerp(Point &one, Point &two, GLfloat t) {
     return pt;
 }
 
+// Runs body(i) for every i in [0, n), handing indices out to one thread
+// per core as they finish
+template <class F>
+void parallelFor(int n, F body) {
+    int n_threads = MAX(1, MIN((int)thread::hardware_concurrency(), n));
+    atomic<int> next(0);
+    vector<thread> threads;
+    for(int t = 0; t < n_threads; ++t) {
+        threads.push_back(thread([&]() {
+            for(int i = next++; i < n; i = next++) body(i);
+        }));
+    }
+    for(size_t t = 0; t < threads.size(); ++t) {
+        threads[t].join();
+    }
+}
+
+// Fewest items worth giving a thread of its own in radixSort()
+#define RADIX_MIN_BLOCK (16384)
+
+// Sorts items by their upper 32 bits, stably, eight bits a pass from the
+// lowest. Each pass splits the items into a block per thread: every block
+// counts its digits, the counts are summed in digit then block order to
+// give each block its own run of the output, and the blocks scatter at once
+void radixSort(vector<uint64_t> &items) {
+    size_t n = items.size();
+    int n_blocks = MAX(1, MIN((int)thread::hardware_concurrency(), (int)(n / RADIX_MIN_BLOCK)));
+    size_t block = (n + n_blocks - 1) / n_blocks;
+    vector<uint64_t> out(n);
+    vector<size_t> counts(256 * n_blocks);
+    for(int shift = 32; shift < 64; shift += 8) {
+        fill(counts.begin(), counts.end(), 0);
+        parallelFor(n_blocks, [&](int b) {
+            size_t *count = &counts[256 * b];
+            for(size_t i = b * block; i < n && i < (b+1) * block; ++i) {
+                count[(items[i] >> shift) & 0xff]++;
+            }
+        });
+
+        size_t sum = 0;
+        for(int d = 0; d < 256; ++d) {
+            for(int b = 0; b < n_blocks; ++b) {
+                size_t c = counts[256 * b + d];
+                counts[256 * b + d] = sum;
+                sum += c;
+            }
+        }
+
+        parallelFor(n_blocks, [&](int b) {
+            size_t *next = &counts[256 * b];
+            for(size_t i = b * block; i < n && i < (b+1) * block; ++i) {
+                out[next[(items[i] >> shift) & 0xff]++] = items[i];
+            }
+        });
+        items.swap(out);
+    }
+}
+
+// Interleaves the bits of x and y, x taking the even ones, so that sorting
+// by the result follows a Z-order curve
+uint32_t mortonKey(uint16_t x, uint16_t y) {
+    uint32_t k[2] = { x, y };
+    for(int a = 0; a < 2; ++a) {
+        k[a] = (k[a] | (k[a] << 8)) & 0x00ff00ff;
+        k[a] = (k[a] | (k[a] << 4)) & 0x0f0f0f0f;
+        k[a] = (k[a] | (k[a] << 2)) & 0x33333333;
+        k[a] = (k[a] | (k[a] << 1)) & 0x55555555;
+    }
+    return k[0] | (k[1] << 1);
+}
+
+// 64-bit FNV-1a taken eight bytes at a time, carrying on from h. Enough to
+// tell files apart, not to stand up to anyone making them collide
+uint64_t hashBytes(const void *data, size_t n, uint64_t h = 14695981039346656037ULL) {
+    const unsigned char *p = (const unsigned char *)data;
+    for(; n >= 8; n -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        h = (h ^ word) * 1099511628211ULL;
+    }
+    for(; n > 0; --n, ++p) {
+        h = (h ^ *p) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Twice the signed area of abc projected onto the xy plane. Positive when
+// a, b and c wind counter-clockwise
+GLfloat orient(const Point &a, const Point &b, const Point &c) {
+    return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+}
+
+// Sign of orient(a, b, c) without rounding error. Evaluated in double it is
+// nearly always clear of its error bound (Shewchuk's ccwerrboundA). When it
+// is not, the six products of float coordinates are each exact in double,
+// and summing them into a nonoverlapping expansion loses nothing, so the
+// sign of its largest component is the answer
+int orientSign(const Point &a, const Point &b, const Point &c) {
+    double left = ((double)b.x - a.x) * ((double)c.y - a.y);
+    double right = ((double)b.y - a.y) * ((double)c.x - a.x);
+    double det = left - right;
+    double bound = (3.0 + 16.0 * DBL_EPSILON/2) * DBL_EPSILON/2 * (fabs(left) + fabs(right));
+    if(det > bound) return 1;
+    if(-det > bound) return -1;
+
+    double terms[6] = { (double)a.x * b.y, -(double)a.x * c.y, -(double)a.y * b.x,
+                        (double)a.y * c.x, (double)b.x * c.y, -(double)b.y * c.x };
+    double e[6];
+    int n = 0;
+    for(int i = 0; i < 6; ++i) {
+        double q = terms[i];
+        int m = 0;
+        for(int j = 0; j < n; ++j) {
+            double sum = q + e[j];
+            double virt = sum - q;
+            double err = (q - (sum - virt)) + (e[j] - virt);
+            q = sum;
+            if(err != 0) e[m++] = err;
+        }
+        e[m++] = q;
+        n = m;
+    }
+    return e[n-1] > 0 ? 1 : (e[n-1] < 0 ? -1 : 0);
+}
+
+// Index a query point takes in leftTurn(), after every vertex
+#define QUERY_INDEX (UINT_MAX)
+
+// minmaxer's leftTurnCoords() (sos.c): whether a, b, c turn left, with a, b
+// and c numbered sa, sb and sc. Simulation of Simplicity settles the
+// collinear case as if each point were nudged by an amount shrinking with
+// its number, so the answer is never a tie and swapping two points always
+// flips it
+bool leftTurn(Point a, GLuint sa, Point b, GLuint sb, Point c, GLuint sc) {
+    bool flip = false;
+    if(sa > sb) {
+        swap(a, b);
+        swap(sa, sb);
+        flip = !flip;
+    }
+    if(sb > sc) {
+        swap(b, c);
+        swap(sb, sc);
+        flip = !flip;
+        if(sa > sb) {
+            swap(a, b);
+            swap(sa, sb);
+            flip = !flip;
+        }
+    }
+
+    // The same perturbation cases as leftTurnMath()
+    int det = orientSign(a, b, c);
+    if(det == 0) det = (c.x > b.x) - (c.x < b.x);
+    if(det == 0) det = (b.y > c.y) - (b.y < c.y);
+    if(det == 0) det = (a.x > c.x) - (a.x < c.x);
+    if(det == 0) det = 1;
+    return (det > 0) != flip;
+}
+
+// Whether d is inside the circle through a, b and c, which wind
+// counter-clockwise in the xy plane: 1 inside, -1 outside, and 0 when the
+// double evaluation is within Shewchuk's iccerrboundA of zero and too close
+// to call
+int inCircleSign(const Point &a, const Point &b, const Point &c, const Point &d) {
+    double adx = (double)a.x - d.x, ady = (double)a.y - d.y;
+    double bdx = (double)b.x - d.x, bdy = (double)b.y - d.y;
+    double cdx = (double)c.x - d.x, cdy = (double)c.y - d.y;
+    double bc = bdx * cdy, cb = cdx * bdy;
+    double ca = cdx * ady, ac = adx * cdy;
+    double ab = adx * bdy, ba = bdx * ady;
+    double alift = adx*adx + ady*ady;
+    double blift = bdx*bdx + bdy*bdy;
+    double clift = cdx*cdx + cdy*cdy;
+    double det = alift * (bc - cb) + blift * (ca - ac) + clift * (ab - ba);
+    double permanent = (fabs(bc) + fabs(cb)) * alift + (fabs(ca) + fabs(ac)) * blift +
+                       (fabs(ab) + fabs(ba)) * clift;
+    double bound = (10.0 + 96.0 * DBL_EPSILON/2) * DBL_EPSILON/2 * permanent;
+    if(det > bound) return 1;
+    if(-det > bound) return -1;
+    return 0;
+}
+
+// Real roots of q[0]*t^2 + q[1]*t + q[2], smallest first. Returns how many
+int quadraticRoots(const double q[3], double roots[2]) {
+    if(q[0] == 0) {
+        if(q[1] == 0) return 0;
+        roots[0] = -q[2] / q[1];
+        return 1;
+    }
+
+    double disc = q[1]*q[1] - 4*q[0]*q[2];
+    if(disc < 0) return 0;
+
+    // Avoids cancellation between -b and the root of the discriminant
+    double s = q[1] >= 0 ? -0.5 * (q[1] + sqrt(disc)) : -0.5 * (q[1] - sqrt(disc));
+    roots[0] = s / q[0];
+    roots[1] = s != 0 ? q[2] / s : roots[0];
+    if(roots[0] > roots[1]) swap(roots[0], roots[1]);
+    return 2;
+}
+
+// Delaunay triangulation of points in the xy plane. The points go in one at
+// a time along a Z-order curve, so the walk to each one's triangle from the
+// last one's is short, inside a triangle far bigger than them all whose
+// corners are dropped at the end. Each point splits the triangle or edge it
+// lands on, then edges across from it are flipped until every circumcircle
+// is empty again. A flip inCircleSign() cannot call is left alone, which
+// can only leave a near tie the other way, and keeps the flipping finite
+class Delaunay {
+public:
+    Delaunay(const vector<Point> &points) : adjacent(points.size()), n(points.size()),
+                                            twin(points.size(), -1), random(1) {
+        if(n == 0) return;
+
+        Point low = points[0], high = points[0];
+        for(int i = 0; i < n; ++i) {
+            corners.push_back(Point(points[i].x, points[i].y, 0));
+            low.x = MIN(low.x, points[i].x);
+            low.y = MIN(low.y, points[i].y);
+            high.x = MAX(high.x, points[i].x);
+            high.y = MAX(high.y, points[i].y);
+        }
+        GLfloat size = MAX(MAX(high.x - low.x, high.y - low.y), 1);
+        GLfloat cx = (low.x + high.x) / 2, cy = (low.y + high.y) / 2;
+        corners.push_back(Point(cx - 20 * size, cy - 10 * size, 0));
+        corners.push_back(Point(cx + 20 * size, cy - 10 * size, 0));
+        corners.push_back(Point(cx, cy + 20 * size, 0));
+        make(0, n, n + 1, n + 2, -1, -1, -1);
+
+        GLfloat sx = 65535 / MAX(high.x - low.x, FLT_MIN);
+        GLfloat sy = 65535 / MAX(high.y - low.y, FLT_MIN);
+        vector<uint64_t> order(n);
+        for(int i = 0; i < n; ++i) {
+            uint32_t key = mortonKey((points[i].x - low.x) * sx, (points[i].y - low.y) * sy);
+            order[i] = (uint64_t)key << 32 | i;
+        }
+        radixSort(order);
+
+        int t = 0;
+        for(int k = 0; k < n; ++k) {
+            t = insert((GLuint)order[k], t);
+        }
+
+        // Every edge between two points is in two triangles, once each way
+        for(size_t f = 0; f < mesh.size(); ++f) {
+            for(int k = 0; k < 3; ++k) {
+                int a = mesh[f].v[k];
+                int b = mesh[f].v[(k+1) % 3];
+                if(a < b && b < n) {
+                    adjacent[a].push_back(b);
+                    adjacent[b].push_back(a);
+                }
+            }
+        }
+        for(int i = 0; i < n; ++i) {
+            int m = twin[i];
+            if(m < 0) continue;
+
+            adjacent[i] = adjacent[m];
+            for(size_t k = 0; k < adjacent[i].size(); ++k) {
+                adjacent[adjacent[i][k]].push_back(i);
+            }
+            adjacent[i].push_back(m);
+            adjacent[m].push_back(i);
+        }
+    }
+
+    // Points joined to each point by an edge, always both ways. A point on
+    // top of an earlier one is joined to it and to all of its neighbours
+    vector<vector<int> > adjacent;
+
+private:
+    // Corners v counter-clockwise, and across the edge from v[k] to
+    // v[k+1] the triangle n[k], -1 if that is outside
+    struct Face {
+        int v[3];
+        int n[3];
+    };
+
+    // Sets triangle t, adding it if it is one past the last
+    void make(int t, int a, int b, int c, int nab, int nbc, int nca) {
+        Face f = { { a, b, c }, { nab, nbc, nca } };
+        if(t == (int)mesh.size()) {
+            mesh.push_back(f);
+        } else {
+            mesh[t] = f;
+        }
+    }
+
+    // Points triangle t's edge from a to b, if t exists, at triangle now
+    void relink(int t, int a, int b, int now) {
+        if(t < 0) return;
+        for(int k = 0; k < 3; ++k) {
+            if(mesh[t].v[k] == a && mesh[t].v[(k+1) % 3] == b) mesh[t].n[k] = now;
+        }
+    }
+
+    // Walks from triangle t towards p, crossing any edge p is on the far
+    // side of, starting from a random one each step so the walk cannot
+    // circle. Returns the triangle p is in and sets edge to one of its
+    // edges p lies on, -1 if none
+    int locate(const Point &p, int t, int &edge) {
+        for(;;) {
+            int first = random() % 3;
+            int next = -1;
+            edge = -1;
+            for(int j = 0; j < 3 && next < 0; ++j) {
+                int k = (first + j) % 3;
+                int side = orientSign(corners[mesh[t].v[k]], corners[mesh[t].v[(k+1) % 3]], p);
+                if(side < 0) next = mesh[t].n[k];
+                if(side == 0) edge = k;
+            }
+            if(next < 0) return t;
+            t = next;
+        }
+    }
+
+    // Adds point i, starting the search for it from triangle t, and returns
+    // a triangle next to it to start the next search from
+    int insert(int i, int t) {
+        int edge;
+        t = locate(corners[i], t, edge);
+        for(int k = 0; k < 3; ++k) {
+            const Point &v = corners[mesh[t].v[k]];
+            if(v.x == corners[i].x && v.y == corners[i].y) {
+                twin[i] = mesh[t].v[k];
+                return t;
+            }
+        }
+
+        Face f = mesh[t];
+        int t1 = mesh.size();
+        int t2 = t1 + 1;
+        if(edge < 0) {
+            int a = f.v[0], b = f.v[1], c = f.v[2];
+            make(t, a, b, i, f.n[0], t1, t2);
+            make(t1, b, c, i, f.n[1], t2, t);
+            make(t2, c, a, i, f.n[2], t, t1);
+            relink(f.n[1], c, b, t1);
+            relink(f.n[2], a, c, t2);
+            flips.push_back(t);
+            flips.push_back(t1);
+            flips.push_back(t2);
+        } else {
+            // i is on the edge from a to b, which the triangle u across it
+            // has from b to a with d opposite
+            int a = f.v[edge], b = f.v[(edge+1) % 3], c = f.v[(edge+2) % 3];
+            int nbc = f.n[(edge+1) % 3], nca = f.n[(edge+2) % 3];
+            int u = f.n[edge];
+            Face g = mesh[u];
+            int k = 0;
+            while(g.v[k] != b) ++k;
+            int d = g.v[(k+2) % 3];
+            int nad = g.n[(k+1) % 3], ndb = g.n[(k+2) % 3];
+            make(t, b, c, i, nbc, u, t2);
+            make(u, c, a, i, nca, t1, t);
+            make(t1, a, d, i, nad, t2, u);
+            make(t2, d, b, i, ndb, t, t1);
+            relink(nca, a, c, u);
+            relink(nad, d, a, t1);
+            relink(ndb, b, d, t2);
+            flips.push_back(t);
+            flips.push_back(u);
+            flips.push_back(t1);
+            flips.push_back(t2);
+        }
+        legalize();
+        return t;
+    }
+
+    // Flips edges until the new point's circle tests pass. Every triangle
+    // on the stack has the new point p as v[2], and its edge 0 across from
+    // p is the one to test against the triangle on the other side
+    void legalize() {
+        while(!flips.empty()) {
+            int t = flips.back();
+            flips.pop_back();
+            int u = mesh[t].n[0];
+            if(u < 0) continue;
+
+            int a = mesh[t].v[0], b = mesh[t].v[1], p = mesh[t].v[2];
+            int k = 0;
+            while(mesh[u].v[k] != b) ++k;
+            int d = mesh[u].v[(k+2) % 3];
+            if(inCircleSign(corners[a], corners[b], corners[p], corners[d]) <= 0) continue;
+
+            int nad = mesh[u].n[(k+1) % 3], ndb = mesh[u].n[(k+2) % 3];
+            int nbp = mesh[t].n[1], npa = mesh[t].n[2];
+            make(t, a, d, p, nad, u, npa);
+            make(u, d, b, p, ndb, nbp, t);
+            relink(nad, d, a, t);
+            relink(nbp, p, b, u);
+            flips.push_back(t);
+            flips.push_back(u);
+        }
+    }
+
+    int n;
+    vector<Point> corners;
+    vector<Face> mesh;
+    vector<int> flips;
+    vector<int> twin;
+    std::minstd_rand random;
+};
+
 struct Site {
     Point p;
     bool locked;
 };
 
 
-class Salesman {
-public:
-    Salesman(vector<Site> &bag) : left(bag) { }
+// Most sites Salesman solves by Held-Karp. Its table holds 2^(n-1) * n
+// floats and the time grows as 2^n * n^2, half a second at 20 sites
+#define SALESMAN_MAX_EXACT (20)
+
+// Most sites the branch and bound takes on, one bit each in a visited set
+#define SALESMAN_MAX_BRANCH (64)
+
+// A thread only hands branches to idle ones while more than this many sites
+// are left to place; smaller subtrees are quicker to search than to share
+#define BRANCH_MIN_SPLIT (6)
+
+// Default time Salesman::solve() may take, in seconds
+#define SALESMAN_BUDGET (2.0)
+
+// Nearest sites each site's local search moves are looked for among, out of
+// its Delaunay neighbours and theirs
+#define SALESMAN_NEIGHBORS (10)
+
+// Kicks in a row that find no shorter path before the local search gives up
+// early, which it only does on paths small enough to be done with
+#define SALESMAN_MAX_STALLS (1000)
+
+// Orders the sites into the shortest path through all of them, starting and
+// ending anywhere, or the shortest found in the time budget. Straight line
+// distances between sites are worked out once when there are few enough
+// for the branch and bound, and as needed otherwise, unless setCosts()
+// gives the costs of every pair instead
+class Salesman {
+public:
+    Salesman(vector<Site> &bag) : sites(bag), n(bag.size()), budget(SALESMAN_BUDGET),
+                                  proven(false), workers(NULL) {
+        if(n > SALESMAN_MAX_BRANCH) return;
+
+        dist.resize(n * n);
+        for(int i = 0; i < n; ++i) {
+            for(int j = 0; j < n; ++j) {
+                dist[i*n + j] = (sites[i].p - sites[j].p).norm();
+            }
+        }
+    }
+
+    void setBudget(double seconds) {
+        budget = seconds;
+    }
+
+    // Uses costs[i*n + j] as the cost of going between sites i and j in
+    // place of the straight line distance. It must be the same both ways
+    void setCosts(const vector<GLfloat> &costs) {
+        dist = costs;
+    }
+
+    // Exact by Held-Karp for few sites, whatever the budget. Up to
+    // SALESMAN_MAX_BRANCH the branch and bound starts from what a quarter
+    // of the budget of local search finds and either proves the shortest
+    // path or runs out of budget first; past that the local search has it
+    // all. Either way the best path found in time comes back, and
+    // provenShortest() says which it was
+    vector<Site> solve() {
+        using namespace std::chrono;
+        steady_clock::time_point start = steady_clock::now();
+        vector<int> order;
+        proven = false;
+        if(n <= SALESMAN_MAX_EXACT) {
+            order = heldKarp();
+            proven = true;
+        } else if(n <= SALESMAN_MAX_BRANCH) {
+            deadline = start + duration_cast<steady_clock::duration>(duration<double>(budget / 4));
+            vector<int> seed = localSearch();
+            deadline = start + duration_cast<steady_clock::duration>(duration<double>(budget));
+            order = branchAndBound(seed);
+        } else {
+            deadline = start + duration_cast<steady_clock::duration>(duration<double>(budget));
+            order = localSearch();
+        }
+        vector<Site> path;
+        for(size_t k = 0; k < order.size(); ++k) {
+            path.push_back(sites[order[k]]);
+        }
+        return path;
+    }
+
+    // Whether the last solve() proved its path the shortest rather than
+    // handing back the best it found before the budget ran out
+    bool provenShortest() {
+        return proven;
+    }
+
+private:
+    // Slot in the table for the shortest path through the set S ending at
+    // j, which must be in S. S minus j is squeezed down to n-1 bits by
+    // closing the gap where j was
+    size_t slot(uint32_t S, int j) {
+        uint32_t low = S & ((1u << j) - 1);
+        uint32_t high = S >> (j + 1);
+        return (size_t)(low | (high << j)) * n + j;
+    }
+
+    // Shortest path through S ending at j, given the table filled in for
+    // every smaller set, and the site before j on it, -1 if j is alone
+    GLfloat bestInto(const vector<GLfloat> &best, uint32_t S, int j, int &prev) {
+        uint32_t rest = S & ~(1u << j);
+        prev = -1;
+        if(rest == 0) return 0;
+
+        GLfloat shortest = FLT_MAX;
+        for(uint32_t r = rest; r; r &= r - 1) {
+            int i = __builtin_ctz(r);
+            GLfloat length = best[slot(rest, i)] + dist[i*n + j];
+            if(length < shortest) {
+                shortest = length;
+                prev = i;
+            }
+        }
+        return shortest;
+    }
+
+    // Held-Karp dynamic programming over subsets. Every subset is numbered
+    // above all of its own subsets, so counting up fills the table in an
+    // order where each entry's predecessors are done. The path is then
+    // traced back by asking the same question again of each set, which
+    // costs far less than a table of predecessors
+    vector<int> heldKarp() {
+        vector<int> order;
+        if(n == 0) return order;
+
+        uint32_t all = (1u << n) - 1;
+        vector<GLfloat> best((size_t)n << (n - 1));
+        int prev;
+        for(uint32_t S = 1; S <= all; ++S) {
+            for(uint32_t s = S; s; s &= s - 1) {
+                int j = __builtin_ctz(s);
+                best[slot(S, j)] = bestInto(best, S, j, prev);
+            }
+        }
+
+        int last = 0;
+        for(int j = 1; j < n; ++j) {
+            if(best[slot(all, j)] < best[slot(all, last)]) last = j;
+        }
+
+        uint32_t S = all;
+        for(int j = last; j >= 0; j = prev) {
+            order.push_back(j);
+            bestInto(best, S, j, prev);
+            S &= ~(1u << j);
+        }
+        std::reverse(order.begin(), order.end());
+        return order;
+    }
+
+    // Distance between sites i and j, where site n is the one local search
+    // adds that is no distance from anything
+    GLfloat cost(int i, int j) {
+        if(i == n || j == n) return 0;
+        if(!dist.empty()) return dist[i*n + j];
+        return (sites[i].p - sites[j].p).norm();
+    }
+
+    bool expired() {
+        return std::chrono::steady_clock::now() > deadline;
+    }
+
+    // Goes to the nearest site not yet visited each time. Once
+    // findNeighbors() has run, that is looked for among the site's
+    // candidates, which nearly always hold it, and only once they are all
+    // visited among every site left
+    vector<int> nearestNeighbor(int start) {
+        vector<int> order;
+        vector<bool> visited(n, false);
+
+        // The sites not yet visited, site j at left[spot[j]]
+        vector<int> left(n), spot(n);
+        for(int j = 0; j < n; ++j) {
+            left[j] = spot[j] = j;
+        }
+
+        for(int cur = start < n ? start : -1; cur >= 0; ) {
+            order.push_back(cur);
+            visited[cur] = true;
+            left[spot[cur]] = left.back();
+            spot[left.back()] = spot[cur];
+            left.pop_back();
+
+            int next = -1;
+            GLfloat nearest = FLT_MAX;
+            if(cur < (int)neighbors.size()) {
+                for(size_t k = 0; k < neighbors[cur].size(); ++k) {
+                    int j = neighbors[cur][k];
+                    if(j == n || visited[j]) continue;
+                    GLfloat d = cost(cur, j);
+                    if(d < nearest) {
+                        nearest = d;
+                        next = j;
+                    }
+                }
+            }
+            if(next < 0) {
+                for(size_t k = 0; k < left.size(); ++k) {
+                    GLfloat d = cost(cur, left[k]);
+                    if(d < nearest) {
+                        nearest = d;
+                        next = left[k];
+                    }
+                }
+            }
+            cur = next;
+        }
+        return order;
+    }
+
+    GLfloat pathLength(const vector<int> &order) {
+        GLfloat length = 0;
+        for(size_t k = 1; k < order.size(); ++k) {
+            length += cost(order[k-1], order[k]);
+        }
+        return length;
+    }
+
+    // The path is kept as a cycle through the sites and site n, cutting it
+    // there gives the path back. cycle[where[c]] == c
+    int next(int c) {
+        return cycle[where[c] + 1 == n + 1 ? 0 : where[c] + 1];
+    }
+
+    int prev(int c) {
+        return cycle[where[c] == 0 ? n : where[c] - 1];
+    }
+
+    // Reverses the cycle from a forwards to b, or the rest of it instead
+    // when that is shorter, which makes the same cycle
+    void reverse(int a, int b) {
+        int size = n + 1;
+        int i = where[a];
+        int j = where[b];
+        int length = (j - i + size) % size + 1;
+        if(2 * length > size) {
+            i = (j + 1) % size;
+            j = (where[a] + size - 1) % size;
+            length = size - length;
+        }
+        for(int k = 0; k < length / 2; ++k) {
+            int x = cycle[i];
+            int y = cycle[j];
+            cycle[i] = y;
+            where[y] = i;
+            cycle[j] = x;
+            where[x] = j;
+            i = i + 1 == size ? 0 : i + 1;
+            j = j == 0 ? size - 1 : j - 1;
+        }
+    }
+
+    // Swaps edges (a, b) and (c, d) for (a, c) and (b, d), where b follows a
+    // and d follows c going the same way round the cycle, whichever way
+    // that is
+    void exchange(int a, int b, int c, int d) {
+        assert(next(a) == b ? next(c) == d : prev(a) == b && prev(c) == d);
+        if(next(a) == b) {
+            reverse(b, c);
+        } else {
+            reverse(c, b);
+        }
+    }
+
+    // 2-opt: replaces the edge from a to its successor (or predecessor) and
+    // another such edge near a with two shorter ones. Candidates come
+    // from a's neighbours, stopping once the new edge from a alone is longer
+    // than the one it replaces
+    bool twoOpt(int a, vector<int> &touched) {
+        for(int forward = 1; forward >= 0; --forward) {
+            int a2 = forward ? next(a) : prev(a);
+            GLfloat removed = cost(a, a2);
+            for(size_t k = 0; k < neighbors[a].size(); ++k) {
+                int c = neighbors[a][k];
+                GLfloat added = cost(a, c);
+                if(added >= removed) break;
+
+                int c2 = forward ? next(c) : prev(c);
+                if(c == a2 || c2 == a) continue;
+
+                GLfloat gain = removed + cost(c, c2) - added - cost(a2, c2);
+                if(gain <= 0) continue;
+
+                exchange(a, a2, c, c2);
+                touched.push_back(a);
+                touched.push_back(a2);
+                touched.push_back(c);
+                touched.push_back(c2);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Or-opt: moves the one to three sites from a forwards to between two
+    // neighbouring sites elsewhere, either way round. The move is made as
+    // two or three exchanges
+    bool orOpt(int a, vector<int> &touched) {
+        int s2 = a;
+        for(int length = 1; length <= 3 && length < n - 1; ++length, s2 = next(s2)) {
+            int s1 = a;
+            int p = prev(s1);
+            int q = next(s2);
+            if(q == p) break;
+            GLfloat removed = cost(p, s1) + cost(s2, q) - cost(p, q);
+            if(removed <= 0) continue;
+
+            for(int end = 0; end < 2; ++end) {
+                int s = end ? s2 : s1;
+                for(size_t k = 0; k < neighbors[s].size(); ++k) {
+                    int c = neighbors[s][k];
+                    for(int side = 0; side < 2; ++side) {
+                        int x = side ? prev(c) : c;
+                        int y = next(x);
+                        if(x == p || inSegment(x, s1, length) || inSegment(y, s1, length)) continue;
+
+                        GLfloat gap = cost(x, y);
+                        GLfloat flipped = cost(x, s2) + cost(s1, y) - gap;
+                        GLfloat straight = cost(x, s1) + cost(s2, y) - gap;
+                        if(MIN(flipped, straight) >= removed) continue;
+
+                        exchange(p, s1, x, y);
+                        exchange(p, x, q, s2);
+                        if(straight < flipped) exchange(x, s2, s1, y);
+                        int moved[] = { p, q, x, y, s1, s2 };
+                        touched.insert(touched.end(), moved, moved + 6);
+                        return true;
+                    }
+                }
+            }
+        }
+        return false;
+    }
+
+    bool inSegment(int c, int first, int length) {
+        return (where[c] - where[first] + n + 1) % (n + 1) < length;
+    }
+
+    GLfloat cycleLength() {
+        GLfloat length = 0;
+        for(int k = 0; k <= n; ++k) {
+            length += cost(cycle[k], cycle[k == n ? 0 : k + 1]);
+        }
+        return length;
+    }
+
+    // Applies 2-opt and Or-opt moves until none helps. Sites are looked at
+    // from a queue, and one that yields nothing stays off it (its don't look
+    // bit is set) until a move changes an edge next to it
+    void improve(std::deque<int> &queue, vector<bool> &queued) {
+        vector<int> touched;
+        while(!queue.empty() && !expired()) {
+            int a = queue.front();
+            queue.pop_front();
+            queued[a] = false;
+
+            touched.clear();
+            if(!twoOpt(a, touched) && !orOpt(a, touched)) continue;
+
+            for(size_t k = 0; k < touched.size(); ++k) {
+                if(!queued[touched[k]]) {
+                    queued[touched[k]] = true;
+                    queue.push_back(touched[k]);
+                }
+            }
+        }
+    }
+
+    // The sites each site's moves are looked for among: the nearest
+    // SALESMAN_NEIGHBORS of its Delaunay neighbours and their neighbours,
+    // which between them nearly always hold its nearest sites, found in
+    // O(n log n) rather than by measuring every pair. Site n's are never
+    // searched from, as it is as near to everything as it can be; every
+    // site has it as its first
+    void findNeighbors() {
+        vector<Point> points(n);
+        for(int i = 0; i < n; ++i) {
+            points[i] = sites[i].p;
+        }
+        Delaunay mesh(points);
+
+        neighbors.assign(n + 1, vector<int>());
+        vector<int> seen(n, -1);
+        vector<pair<GLfloat, int> > by_cost;
+        for(int i = 0; i < n; ++i) {
+            by_cost.clear();
+            seen[i] = i;
+            for(size_t a = 0; a < mesh.adjacent[i].size(); ++a) {
+                int j = mesh.adjacent[i][a];
+                for(size_t b = 0; b <= mesh.adjacent[j].size(); ++b) {
+                    int k = b == 0 ? j : mesh.adjacent[j][b - 1];
+                    if(seen[k] == i) continue;
+                    seen[k] = i;
+                    by_cost.push_back(make_pair(cost(i, k), k));
+                }
+            }
+            int k_nearest = MIN(SALESMAN_NEIGHBORS, (int)by_cost.size());
+            partial_sort(by_cost.begin(), by_cost.begin() + k_nearest, by_cost.end());
+            neighbors[i].push_back(n);
+            for(int k = 0; k < k_nearest; ++k) {
+                neighbors[i].push_back(by_cost[k].second);
+            }
+        }
+    }
+
+    // Nearest neighbour path improved by local search, then kicked with
+    // random double bridges (three cuts, the middle two pieces swapped) and
+    // improved again, keeping whichever is shortest, until the deadline
+    vector<int> localSearch() {
+        if(n < 4) return nearestNeighbor(0);
+
+        findNeighbors();
+        vector<int> order = nearestNeighbor(0);
+
+        cycle = order;
+        cycle.push_back(n);
+        where.resize(n + 1);
+        for(int k = 0; k <= n; ++k) {
+            where[cycle[k]] = k;
+        }
+
+        std::deque<int> queue(cycle.begin(), cycle.end());
+        vector<bool> queued(n + 1, true);
+        improve(queue, queued);
+
+        vector<int> best = cycle;
+        GLfloat best_length = cycleLength();
+        std::minstd_rand random(1);
+        for(int stalls = 0; stalls < SALESMAN_MAX_STALLS || n > SALESMAN_MAX_BRANCH; ) {
+            if(expired()) break;
+
+            int cut[3];
+            for(int k = 0; k < 3; ++k) {
+                cut[k] = 1 + random() % n;
+            }
+            sort(cut, cut + 3);
+            if(cut[0] == cut[1] || cut[1] == cut[2]) continue;
+
+            int ends[6];
+            for(int k = 0; k < 3; ++k) {
+                ends[2*k] = cycle[cut[k] - 1];
+                ends[2*k + 1] = cycle[cut[k] % (n + 1)];
+            }
+
+            vector<int> kicked(cycle.begin(), cycle.begin() + cut[0]);
+            kicked.insert(kicked.end(), cycle.begin() + cut[1], cycle.begin() + cut[2]);
+            kicked.insert(kicked.end(), cycle.begin() + cut[0], cycle.begin() + cut[1]);
+            kicked.insert(kicked.end(), cycle.begin() + cut[2], cycle.end());
+            cycle.swap(kicked);
+            for(int k = 0; k <= n; ++k) {
+                where[cycle[k]] = k;
+            }
+            for(int k = 0; k < 6; ++k) {
+                if(!queued[ends[k]]) {
+                    queued[ends[k]] = true;
+                    queue.push_back(ends[k]);
+                }
+            }
+            improve(queue, queued);
+
+            GLfloat length = cycleLength();
+            if(length < best_length) {
+                best = cycle;
+                best_length = length;
+                stalls = 0;
+            } else {
+                cycle = best;
+                for(int k = 0; k <= n; ++k) {
+                    where[cycle[k]] = k;
+                }
+                stalls++;
+            }
+        }
+
+        // Cut the cycle at site n
+        int at = find(best.begin(), best.end(), n) - best.begin();
+        order.clear();
+        for(int k = 1; k <= n; ++k) {
+            order.push_back(best[(at + k) % (n + 1)]);
+        }
+        return order;
+    }
+
+    // A path being extended by the branch and bound: the sites on it in
+    // order, the same as a set and its length so far
+    struct Branch {
+        vector<int> path;
+        uint64_t visited;
+        GLfloat length;
+    };
+
+    // One thread's branches. It works from the back, depth first, and idle
+    // threads steal from the front, where the branches are biggest
+    struct BranchDeque {
+        std::mutex lock;
+        std::deque<Branch> branches;
+    };
+
+    // Depth first search split over every core. Each thread searches its
+    // branches on its own, and while any thread is idle it sets aside the
+    // siblings of whatever it descends into for others to steal. The best
+    // length so far prunes every thread's search and starts out as seed's.
+    // At the deadline the search stops with the best it has, and otherwise
+    // that is proven the shortest
+    vector<int> branchAndBound(const vector<int> &seed) {
+        by_distance.resize(n * n);
+        for(int i = 0; i < n; ++i) {
+            int *order = &by_distance[i*n];
+            for(int j = 0; j < n; ++j) order[j] = j;
+            sort(order, order + n, [&](int a, int b) { return dist[i*n + a] < dist[i*n + b]; });
+        }
+
+        best_path = seed;
+        best_length = pathLength(seed);
+
+        int n_threads = MAX(1, (int)thread::hardware_concurrency());
+        vector<BranchDeque> deques(n_threads);
+        workers = &deques;
+        pending = n;
+        idle = 0;
+        for(int start = 0; start < n; ++start) {
+            Branch b;
+            b.path.push_back(start);
+            b.visited = (uint64_t)1 << start;
+            b.length = 0;
+            deques[start % n_threads].branches.push_back(b);
+        }
+
+        vector<thread> threads;
+        for(int t = 0; t < n_threads; ++t) {
+            threads.push_back(thread(&Salesman::work, this, t));
+        }
+        for(int t = 0; t < n_threads; ++t) {
+            threads[t].join();
+        }
+        workers = NULL;
+        proven = !expired();
+        return best_path;
+    }
+
+    void work(int self) {
+        bool waiting = false;
+        while(!expired()) {
+            Branch b;
+            if(!take(self, b)) {
+                if(pending == 0) break;
+                if(!waiting) idle++;
+                waiting = true;
+                std::this_thread::yield();
+                continue;
+            }
+            if(waiting) idle--;
+            waiting = false;
+
+            search(self, b.path, b.visited, b.length);
+            pending--;
+        }
+        if(waiting) idle--;
+    }
+
+    // The newest of our own branches, or else the oldest of someone else's
+    bool take(int self, Branch &b) {
+        vector<BranchDeque> &deques = *workers;
+        int n_threads = deques.size();
+        for(int k = 0; k < n_threads; ++k) {
+            BranchDeque &d = deques[(self + k) % n_threads];
+            std::lock_guard<std::mutex> guard(d.lock);
+            if(d.branches.empty()) continue;
+
+            if(k == 0) {
+                b = d.branches.back();
+                d.branches.pop_back();
+            } else {
+                b = d.branches.front();
+                d.branches.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void search(int self, vector<int> &path, uint64_t visited, GLfloat length) {
+        uint64_t all = n == 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+        uint64_t rest = all & ~visited;
+
+        // A path and its reverse are the same length, so only paths ending
+        // on a higher site than they start are looked at
+        if(rest == 0) {
+            if(path.size() > 1 && path.back() < path[0]) return;
+
+            std::lock_guard<std::mutex> guard(best_lock);
+            if(length < best_length) {
+                best_length = length;
+                best_path = path;
+            }
+            return;
+        }
+        if((rest >> path[0]) == 0 || expired()) return;
+
+        int last = path.back();
+        if(length + boundRest(last, rest) >= best_length) return;
+
+        bool share = idle > 0 && __builtin_popcountll(rest) > BRANCH_MIN_SPLIT;
+        bool first = true;
+        for(int k = 0; k < n; ++k) {
+            int j = by_distance[last*n + k];
+            if(!(rest >> j & 1)) continue;
+
+            GLfloat next = length + dist[last*n + j];
+            if(next >= best_length) break;
+
+            if(share && !first) {
+                Branch b;
+                b.path = path;
+                b.path.push_back(j);
+                b.visited = visited | ((uint64_t)1 << j);
+                b.length = next;
+                pending++;
+                BranchDeque &d = (*workers)[self];
+                std::lock_guard<std::mutex> guard(d.lock);
+                d.branches.push_back(b);
+            } else {
+                path.push_back(j);
+                search(self, path, visited | ((uint64_t)1 << j), next);
+                path.pop_back();
+            }
+            first = false;
+        }
+    }
+
+    // Whatever order the sites in rest are visited in, the path has to get
+    // to one of them from last and then join them all up, so it is at least
+    // the nearest hop from last plus a minimum spanning tree of rest
+    GLfloat boundRest(int last, uint64_t rest) {
+        int left[SALESMAN_MAX_BRANCH];
+        int k = 0;
+        for(uint64_t r = rest; r; r &= r - 1) {
+            left[k++] = __builtin_ctzll(r);
+        }
+
+        GLfloat hop = FLT_MAX;
+        for(int i = 0; i < k; ++i) {
+            hop = MIN(hop, dist[last*n + left[i]]);
+        }
+
+        // Prim's algorithm, growing the tree from left[0]
+        GLfloat reach[SALESMAN_MAX_BRANCH];
+        for(int i = 1; i < k; ++i) {
+            reach[i] = dist[left[0]*n + left[i]];
+        }
+        GLfloat tree = 0;
+        for(int added = 1; added < k; ++added) {
+            int nearest = added;
+            for(int i = added + 1; i < k; ++i) {
+                if(reach[i] < reach[nearest]) nearest = i;
+            }
+            tree += reach[nearest];
+            swap(left[added], left[nearest]);
+            swap(reach[added], reach[nearest]);
+            for(int i = added + 1; i < k; ++i) {
+                reach[i] = MIN(reach[i], dist[left[added]*n + left[i]]);
+            }
+        }
+        return hop + tree;
+    }
+
+    vector<Site> sites;
+    int n;
+    vector<GLfloat> dist;
+    double budget;
+    std::chrono::steady_clock::time_point deadline;
+    bool proven;
+
+    // Local search state: the cycle and every site's place in it, and the
+    // sites each one's moves are looked for among
+    vector<int> cycle;
+    vector<int> where;
+    vector<vector<int> > neighbors;
+
+    // Branch and bound state shared by its threads. by_distance[i*n] lists
+    // every site by how far it is from site i
+    vector<int> by_distance;
+    vector<BranchDeque> *workers;
+    std::atomic<GLfloat> best_length;
+    std::mutex best_lock;
+    vector<int> best_path;
+    std::atomic<int> pending;
+    std::atomic<int> idle;
+};
+
+
+struct Triangle {
+    GLfloat vs[0];
+    Point v1;
+    Point v2;
+    Point v3;
+
+    Point &vertex(int k) {
+        return k == 0 ? v1 : (k == 1 ? v2 : v3);
+    }
+       
+    GLfloat maxX() {
+        return MAX(MAX(v1.x, v2.x), v3.x);
+    }
+
+    GLfloat minX() {
+        return MIN(MIN(v1.x, v2.x), v3.x);
+    }
+
+    GLfloat maxY() {
+        return MAX(MAX(v1.y, v2.y), v3.y);
+    }
+
+    GLfloat minY() {
+        return MIN(MIN(v1.y, v2.y), v3.y);
+    }
+        
+    GLfloat maxZ() {
+        return MAX(MAX(v1.z, v2.z), v3.z);
+    }
+
+    GLfloat minZ() {
+        return MIN(MIN(v1.z, v2.z), v3.z);
+    }
+
+    bool sameSide (Point p1, Point p2, Point a, Point b) {
+        Vector cp1 = cross(b-a, p1-a);
+        Vector cp2 = cross(b-a, p2-a);
+        if(dot(cp1, cp2) >= 0)
+           return true;
+        return false;
+    }
+
+    bool inside(Point p) {
+        Point a,b,c;
+        a = v1;
+        b = v2;
+        c = v3;
+        p.z = 0;
+        a.z = 0;
+        b.z = 0;
+        c.z = 0;
+        if(sameSide(p,a, b,c) && sameSide(p,b, a,c) && sameSide(p,c, a,b)) 
+            return true;
+        return false;
+    }
+
+    Point findBarycentric(Point &p) {
+        Vector weights, location;
+        Point zero;
+        GLfloat detA = (v1.x*v2.y)-(v1.x*v3.y)-(v2.x*v1.y)+(v2.x*v3.y)+(v3.x*v1.y)-(v3.x*v2.y);
+        weights.x = ((p.x*v2.y)-(p.x*v3.y)-(v2.x*p.y)+(v2.x*v3.y)+(v3.x*p.y)-(v3.x*v2.y))/detA;
+        weights.y = ((v1.x*p.y)-(v1.x*v3.y)-(p.x*v1.y)+(p.x*v3.y)+(v3.x*v1.y)-(v3.x*p.y))/detA;
+        weights.z = ((v1.x*v2.y)-(v1.x*p.y)-(v2.x*v1.y)+(v2.x*p.y)+(p.x*v1.y)-(p.x*v2.y))/detA;
+        location = (weights.x*v1)+(weights.y*v2)+(weights.z*v3); 
+        return (zero+location);
+    }
+    
+};
+
+// Average number of triangles we aim to have in each bucket of the
+// height query grid
+#define TRIS_PER_CELL (2)
+
+// How far outside an edge, in world units, a point may be and still count
+// as inside. Covers float rounding on edges shared by two triangles
+#define EDGE_TOLERANCE (0.01f)
+
+// Bound on the rounding error of a TriangleEq edge value, relative to the
+// magnitude of the coordinates. Point location only trusts the sign of an
+// edge value further than this from zero and asks leftTurn() otherwise
+#define EDGE_FILTER (16 * FLT_EPSILON)
+
+// A triangle reduced to what height queries need. Edge k (from vertex k to
+// vertex k+1) is the line e[k][0]*x + e[k][1]*y + e[k][2] = 0, scaled so the
+// left hand side is the signed distance to it, positive inside. The terrain
+// height over the triangle is z[0]*x + z[1]*y + z[2]
+struct alignas(16) TriangleEq {
+    GLfloat e[3][3];
+    GLfloat z[3];
+
+    void set(Triangle &t) {
+        if(orientSign(t.v1, t.v2, t.v3) <= 0) {
+            // Degenerate, so make sure nothing is ever found inside it
+            for(int k = 0; k < 3; ++k) {
+                e[k][0] = 0; e[k][1] = 0; e[k][2] = -1;
+            }
+            z[0] = 0; z[1] = 0; z[2] = t.v1.z;
+            return;
+        }
+
+        for(int k = 0; k < 3; ++k) {
+            Point &a = t.vertex(k);
+            Point &b = t.vertex((k+1)%3);
+            double dx = b.x - a.x, dy = b.y - a.y;
+            double len = sqrt(dx*dx + dy*dy);
+            e[k][0] = -dy / len;
+            e[k][1] = dx / len;
+            e[k][2] = (dy * a.x - dx * a.y) / len;
+        }
+
+        // Normal of the triangle's plane, solved for z
+        double ux = t.v2.x - t.v1.x, uy = t.v2.y - t.v1.y, uz = t.v2.z - t.v1.z;
+        double vx = t.v3.x - t.v1.x, vy = t.v3.y - t.v1.y, vz = t.v3.z - t.v1.z;
+        double nx = uy*vz - uz*vy, ny = uz*vx - ux*vz, nz = ux*vy - uy*vx;
+        z[0] = -nx / nz;
+        z[1] = -ny / nz;
+        z[2] = (nx*t.v1.x + ny*t.v1.y + nz*t.v1.z) / nz;
+    }
+
+    GLfloat edge(int k, GLfloat x, GLfloat y) const {
+        return e[k][0]*x + e[k][1]*y + e[k][2];
+    }
+
+    bool inside(GLfloat x, GLfloat y) const {
+        return edge(0, x, y) >= -EDGE_TOLERANCE &&
+               edge(1, x, y) >= -EDGE_TOLERANCE &&
+               edge(2, x, y) >= -EDGE_TOLERANCE;
+    }
+
+    GLfloat height(GLfloat x, GLfloat y) const {
+        return z[0]*x + z[1]*y + z[2];
+    }
+
+    // How far along o + t*d the ray meets the triangle, or FLT_MAX if it
+    // misses. t may be negative
+    GLfloat rayHit(const Point &o, const Vector &d) const {
+        GLfloat slope = d.z - z[0]*d.x - z[1]*d.y;
+        if(slope == 0) return FLT_MAX;
+
+        GLfloat t = (height(o.x, o.y) - o.z) / slope;
+        return inside(o.x + t*d.x, o.y + t*d.y) ? t : FLT_MAX;
+    }
+
+    // Cuts the convex polygon poly with n corners down to the part that
+    // inside() accepts and returns how many corners are left. poly needs
+    // room for n+3 of them
+    int clip(GLfloat poly[][2], int n) const {
+        GLfloat cut[9][2];
+        for(int k = 0; k < 3 && n > 0; ++k) {
+            int m = 0;
+            for(int i = 0; i < n; ++i) {
+                GLfloat *a = poly[i];
+                GLfloat *b = poly[(i+1)%n];
+                GLfloat da = edge(k, a[0], a[1]) + EDGE_TOLERANCE;
+                GLfloat db = edge(k, b[0], b[1]) + EDGE_TOLERANCE;
+                if(da >= 0) {
+                    cut[m][0] = a[0];
+                    cut[m][1] = a[1];
+                    m++;
+                }
+                if((da >= 0) != (db >= 0)) {
+                    GLfloat s = da / (da - db);
+                    cut[m][0] = a[0] + s * (b[0] - a[0]);
+                    cut[m][1] = a[1] + s * (b[1] - a[1]);
+                    m++;
+                }
+            }
+            memcpy(poly, cut, sizeof(GLfloat) * 2 * m);
+            n = m;
+        }
+        return n;
+    }
+};
+
+// The TriangleEqs copied out in grid bucket order, one array per
+// coefficient, so the candidates in a cell can be tested SIMD_WIDTH at a time
+struct TriangleSoA {
+    vector<GLfloat> e[3][3];
+    vector<GLfloat> z[3];
+
+    void resize(size_t n, GLfloat fill) {
+        for(int k = 0; k < 3; ++k) {
+            for(int c = 0; c < 3; ++c) e[k][c].assign(n, fill);
+            z[k].assign(n, fill);
+        }
+    }
+
+    void set(size_t i, const TriangleEq &t) {
+        for(int k = 0; k < 3; ++k) {
+            for(int c = 0; c < 3; ++c) e[k][c][i] = t.e[k][c];
+            z[k][i] = t.z[k];
+        }
+    }
+};
+
+// Give up walking and fall back on the grid after this many steps
+#define WALK_MAX_STEPS (64)
+
+// Curve parameters closer than this count as the same place when walking a
+// curve across the terrain
+#define CURVE_EPSILON (1e-6)
+
+// Triangles a curve may pass through without moving before it is nudged on
+#define CURVE_MAX_STALLS (2)
+
+// Passes of the clearance walk that may go by without the curve moving on:
+// a walk and a stall for each allowed stall, and the nudge after them
+#define CURVE_MAX_IDLE (4 * (CURVE_MAX_STALLS + 2))
+
+// Remembers where the last height query landed so that the next nearby
+// query can walk there instead of searching
+struct TerrainCursor {
+    int tile;
+    int tri;
+
+    TerrainCursor() : tile(-1), tri(-1) {}
+};
+
+// Six planes a*x + b*y + c*z + d >= 0 bounding what a camera can see
+struct Frustum {
+    GLfloat planes[6][4];
+
+    // Conservative: a box near a corner may pass without really being visible
+    bool intersects(const Point &lo, const Point &hi) const {
+        for(int i = 0; i < 6; ++i) {
+            const GLfloat *p = planes[i];
+            GLfloat x = p[0] >= 0 ? hi.x : lo.x;
+            GLfloat y = p[1] >= 0 ? hi.y : lo.y;
+            GLfloat z = p[2] >= 0 ? hi.z : lo.z;
+            if(p[0]*x + p[1]*y + p[2]*z + p[3] < 0) return false;
+        }
+        return true;
+    }
+};
+
+// Where along o + t*d, with inv holding 1/d per axis, the ray enters the box
+// between lo and hi, or FLT_MAX if it misses it between t_min and t_max
+GLfloat rayBox(const Point &lo, const Point &hi, const Point &o, const Vector &inv,
+               GLfloat t_min, GLfloat t_max) {
+    GLfloat t0 = (lo.x - o.x) * inv.x, t1 = (hi.x - o.x) * inv.x;
+    t_min = MAX(t_min, MIN(t0, t1));
+    t_max = MIN(t_max, MAX(t0, t1));
+    t0 = (lo.y - o.y) * inv.y; t1 = (hi.y - o.y) * inv.y;
+    t_min = MAX(t_min, MIN(t0, t1));
+    t_max = MIN(t_max, MAX(t0, t1));
+    t0 = (lo.z - o.z) * inv.z; t1 = (hi.z - o.z) * inv.z;
+    t_min = MAX(t_min, MIN(t0, t1));
+    t_max = MIN(t_max, MAX(t0, t1));
+    return t_min <= t_max ? t_min : FLT_MAX;
+}
+
+// Fraction of a sight line at each end where touching the terrain is allowed
+#define LOS_EPSILON (1e-3)
+
+// Most triangles in a leaf of the ray casting hierarchy
+#define BVH_LEAF_TRIANGLES (4)
+
+// Levels of the hierarchy split up before the subtrees below are built in
+// parallel
+#define BVH_SPLIT_DEPTH (6)
+
+// Node of the ray casting hierarchy, bounding all its triangles. A leaf has
+// count > 0 and holds bvh_tris[start] up to bvh_tris[start+count]; otherwise
+// its children are the next node and node start
+struct BVHNode {
+    Point min;
+    Point max;
+    int start;
+    int count;
+};
+
+// Average number of triangles in each separately culled piece of terrain
+#define CHUNK_TRIANGLES (1024)
+
+// Triangles read between each batch handed out to draw while the rest of
+// a terrain loads
+#define PREVIEW_TRIANGLES (16384)
+
+// Number of levels in the terrain hierarchy, each simplified twice as far
+// as the last
+#define LOD_LEVELS (4)
+
+// Each chunk is drawn at the coarsest level whose vertical error looks no
+// bigger on screen than this many pixels
+#define LOD_PIXEL_ERROR (2.0)
+
+// A piece of the terrain with its bounding box. Level l is drawn from
+// first[l] up to first[l] + count[l] in the chunk index buffer and is off
+// by at most error[l] vertically
+struct TerrainChunk {
+    Point min;
+    Point max;
+    int first[LOD_LEVELS];
+    int count[LOD_LEVELS];
+    GLfloat error[LOD_LEVELS];
+};
+
+// A vertex stored as signed 16-bit offsets from the terrain's origin,
+// counted in steps of the terrain's quantization step on each axis. Signed
+// because glVertexPointer takes GL_SHORT but not GL_UNSIGNED_SHORT
+struct QPoint {
+    GLshort x;
+    GLshort y;
+    GLshort z;
+};
+
+// Resolution of the elevation color ramp texture
+#define RAMP_TEXELS (256)
+
+// Binary terrain (.trib) layout: this header, then n_vertices Points as
+// float32 x y z, then 3 * n_triangles uint32 vertex indices, every triangle
+// counter-clockwise. Stored little-endian and mapped straight into memory
+#define TRIB_MAGIC "TRIB"
+#define TRIB_VERSION (1)
+
+// Name of the file listing the tiles in a directory written by split()
+#define TILE_INDEX "index"
+
+struct TribHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t n_vertices;
+    uint32_t n_triangles;
+    float min[3];
+    float max[3];
+};
+
+// Cache of what Terrain::init() builds, one file per input keyed by a hash
+// of its contents and the build parameters: this header, then sections of a
+// uint64 byte count and the bytes, each starting on a cache line so that the
+// file can be mapped and used in place
+#define CACHE_MAGIC "TRIC"
+#define CACHE_VERSION (4)
+#define CACHE_ALIGN (64)
+
+struct CacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+};
+
+// Appends sections to a cache file
+struct CacheWriter {
+    std::ofstream out;
+    size_t offset;
+
+    CacheWriter(const string &file) : out(file.c_str(), std::ios::binary), offset(0) {}
+
+    void write(const void *data, size_t bytes) {
+        out.write((const char *)data, bytes);
+        offset += bytes;
+    }
+
+    void pad() {
+        static const char zeros[CACHE_ALIGN] = {0};
+        write(zeros, (CACHE_ALIGN - offset % CACHE_ALIGN) % CACHE_ALIGN);
+    }
+
+    void section(const void *data, size_t bytes) {
+        uint64_t n = bytes;
+        write(&n, sizeof(n));
+        pad();
+        write(data, bytes);
+        pad();
+    }
+
+    template<class T> void value(const T &v) {
+        section(&v, sizeof(T));
+    }
+
+    template<class T> void array(const vector<T> &v) {
+        section(v.data(), sizeof(T) * v.size());
+    }
+};
+
+// Reads sections back out of a mapped cache file. Anything short or the
+// wrong size clears ok and every read after it fails
+struct CacheReader {
+    const char *base;
+    size_t size;
+    size_t offset;
+    bool ok;
+
+    CacheReader(const void *b, size_t s, size_t start) :
+        base((const char *)b), size(s), offset(start), ok(true) {}
+
+    static size_t align(size_t x) {
+        return (x + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+    }
+
+    // The next section's bytes where they lie in the mapping
+    const void *section(size_t &bytes) {
+        uint64_t n;
+        if(!ok || offset + sizeof(n) > size) {
+            ok = false;
+            return NULL;
+        }
+        memcpy(&n, base + offset, sizeof(n));
+        offset = align(offset + sizeof(n));
+        if(offset > size || n > size - offset) {
+            ok = false;
+            return NULL;
+        }
+        const void *p = base + offset;
+        offset = align(offset + n);
+        bytes = n;
+        return p;
+    }
+
+    template<class T> bool value(T &v) {
+        size_t bytes = 0;
+        const void *p = section(bytes);
+        if(!p || bytes != sizeof(T)) return ok = false;
+        memcpy(&v, p, bytes);
+        return true;
+    }
+
+    template<class T> bool array(vector<T> &v) {
+        size_t bytes = 0;
+        const T *p = (const T *)section(bytes);
+        if(!p || bytes % sizeof(T) != 0) return ok = false;
+        v.assign(p, p + bytes / sizeof(T));
+        return true;
+    }
+};
+
+// Name of the cache file for key in dir
+string cacheFile(const string &dir, uint64_t key, const char *ext) {
+    char name[64];
+    snprintf(name, sizeof(name), "/%016llx.%s", (unsigned long long)key, ext);
+    return dir + name;
+}
+
+// Maps a cache file, or returns NULL if it is missing or was made
+// under a different key
+void *mapCache(const string &file, uint64_t key, size_t &size) {
+    int fd = open(file.c_str(), O_RDONLY);
+    if(fd < 0) return NULL;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) return NULL;
+
+    CacheHeader *header = (CacheHeader *)base;
+    if(memcmp(header->magic, CACHE_MAGIC, 4) != 0 || header->version != CACHE_VERSION ||
+            header->key != key) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    size = st.st_size;
+    return base;
+}
+
+// Writes a cache file under a temporary name and renames it into place
+// once it is whole, so that a crash or another process reading it never
+// sees half of one
+bool writeCacheFile(const string &file, uint64_t key, std::function<void(CacheWriter &)> body) {
+    mkdir(file.substr(0, file.rfind('/')).c_str(), 0777);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+    string temp = file + suffix;
+
+    bool good;
+    {
+        CacheWriter out(temp);
+        CacheHeader header;
+        memcpy(header.magic, CACHE_MAGIC, 4);
+        header.version = CACHE_VERSION;
+        header.key = key;
+        out.write(&header, sizeof(header));
+        out.pad();
+        body(out);
+        out.out.close();
+        good = !out.out.fail();
+    }
+    if(!good || rename(temp.c_str(), file.c_str()) != 0) {
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Sizes and scalars of one level of a cached terrain
+struct CacheCounts {
+    int32_t n_vertices;
+    int32_t n_triangles;
+    int32_t quantized;
+    int32_t has_levels;
+    Point min;
+    Point max;
+    Point q_origin;
+    Point q_step;
+    int32_t grid_w;
+    int32_t grid_h;
+    GLfloat cell_w;
+    GLfloat cell_h;
+    GLfloat level_error[LOD_LEVELS];
+};
+
+class Terrain {
+private:
+    int n_triangles;
+    int n_sites;
+    int n_vertices;
+    Point max_coords;
+    Point min_coords;
+
+    // Triangle i is vertices[indices[3*i]], vertices[indices[3*i+1]] and
+    // vertices[indices[3*i+2]]. Both arrays point into mapping when loaded
+    // from a .trib file and are malloc'ed otherwise
+    Point *vertices;
+    GLuint *indices;
+    void *mapping;
+    size_t mapping_size;
+
+    // In compact mode the vertices live here instead, vertex(i) decodes them
+    // and nothing per triangle is precomputed
+    bool compact;
+    QPoint *qvertices;
+    Point q_origin;
+    Point q_step;
+
+    TriangleEq *eqs;
+    // Elevations at the two ends of the color ramp. The terrain's own z
+    // range unless it is one tile of something bigger
+    GLfloat color_lo;
+    GLfloat color_hi;
+
+    // 1D texture of the color ramp, indexed by relative elevation.
+    // Redone on the next draw() whenever the ramp changes
+    GLuint texture;
+    GLfloat ramp[6][4];
+    bool ramp_dirty;
+
+    // Vertex and index buffer objects, refilled on the next draw() whenever
+    // the terrain changes
+    GLuint vertex_buffer;
+    GLuint index_buffer;
+    bool buffers_dirty;
+
+    vector<TerrainChunk> chunks;
+    vector<GLuint> chunk_indices;
+
+    // Nested sequence of triangulations, levels[0] being this one and each
+    // of the others this one with its vertices clustered like the chunks'
+    // level. Heights on level l are within level_error[l] of ours anywhere,
+    // and within tri_error[t] of ours over level l's triangle t
+    Terrain *levels[LOD_LEVELS];
+    GLfloat level_error[LOD_LEVELS];
+    vector<GLfloat> tri_error;
+
+    // Uniform grid over the xy bounding box. Cell c holds the triangles
+    // cell_tris[cell_start[c]] up to cell_tris[cell_start[c+1]]
+    int grid_w;
+    int grid_h;
+    GLfloat cell_w;
+    GLfloat cell_h;
+    vector<int> cell_start;
+    vector<int> cell_tris;
+    TriangleSoA cell_soa;
+
+    // The triangle across edge k (from vertex k to vertex k+1) of triangle
+    // t is neighbors[3*t+k], or -1 on the hull
+    vector<int> neighbors;
+
+    // Bounding volume hierarchy for rays, in depth first order
+    vector<BVHNode> bvh;
+    vector<int> bvh_tris;
+
+    // Optional raster of the terrain. hm_z holds the ground elevation at
+    // hm_w x hm_h nodes hm_step apart, FLT_MAX off the terrain. The cell
+    // between nodes (i, j) and (i+1, j+1) has the TIN somewhere between
+    // hm_lo and hm_hi over it
+    int hm_w;
+    int hm_h;
+    GLfloat hm_step;
+    vector<GLfloat> hm_z;
+    vector<GLfloat> hm_lo;
+    vector<GLfloat> hm_hi;
+
+    // Directory of cached builds, none if empty, and the key init() worked
+    // out for the file it loaded, 0 if there was none
+    string cache_dir;
+    uint64_t cache_key;
+
+public:
+    Terrain() : n_triangles(0), n_vertices(0), vertices(NULL), indices(NULL),
+                mapping(NULL), mapping_size(0), compact(false), qvertices(NULL), eqs(NULL),
+                color_lo(0), color_hi(0), texture(0), ramp_dirty(true), vertex_buffer(0), index_buffer(0),
+                buffers_dirty(true), grid_w(0), grid_h(0),
+                hm_w(0), hm_h(0), hm_step(0), cache_key(0) {
+        memcpy(ramp, colors, sizeof(ramp));
+        for(int l = 0; l < LOD_LEVELS; ++l) {
+            levels[l] = l == 0 ? this : NULL;
+            level_error[l] = 0;
+        }
+    }
+
+    ~Terrain() {
+        releaseLevels();
+        release();
+        free(eqs);
+        if(vertex_buffer) {
+            glDeleteBuffers(1, &vertex_buffer);
+            glDeleteBuffers(1, &index_buffer);
+        }
+        if(texture) glDeleteTextures(1, &texture);
+    }
+
+    // Handed each batch of triangles as it is read, three corners apiece
+    typedef std::function<void(const Point *, int)> ParseCallback;
+
+    // Loads either a .tri text file or a .trib file from save(), or what was
+    // built from the same file last time if there is a cache directory
+    bool init(const char *file, ParseCallback parsed = nullptr) {
+
+        // Free any existing state from a previous initialization
+        release();
+
+        cache_key = cache_dir.empty() ? 0 : fileKey(file);
+        string cache = cache_key ? cacheFile(cache_dir, cache_key, "cache") : "";
+        if(cache.empty() || !loadCache(cache)) {
+            if(!build(file, parsed)) return false;
+            if(!cache.empty() && !saveCache(cache)) {
+                cerr << "Could not write terrain cache " << cache << endl;
+            }
+        }
+        hm_w = hm_h = 0;
+        color_lo = min_coords.z;
+        color_hi = max_coords.z;
+        buffers_dirty = true;
+        
+        return true;
+    }
+
+    // Just enough of a terrain to draw n triangles given by their corners,
+    // as one chunk at every level. Nothing is built for queries
+    void preview(const Point *corners, int n) {
+        release();
+        n_triangles = n;
+        n_vertices = 3 * n;
+        vertices = (Point*)malloc(sizeof(Point) * MAX(n_vertices, 1));
+        indices = (GLuint*)malloc(sizeof(GLuint) * MAX(n_vertices, 1));
+        memcpy(vertices, corners, sizeof(Point) * n_vertices);
+        for(int i = 0; i < n_vertices; ++i) {
+            indices[i] = i;
+        }
+        orientTriangles();
+        findBounds();
+
+        chunks.clear();
+        chunk_indices.assign(indices, indices + n_vertices);
+        TerrainChunk chunk;
+        chunk.min = min_coords;
+        chunk.max = max_coords;
+        for(int level = 0; level < LOD_LEVELS; ++level) {
+            chunk.first[level] = 0;
+            chunk.count[level] = n_vertices;
+            chunk.error[level] = 0;
+        }
+        chunks.push_back(chunk);
+        color_lo = min_coords.z;
+        color_hi = max_coords.z;
+        buffers_dirty = true;
+    }
+
+    // Bounding box of a .tri or .trib file without loading it. A .trib file
+    // has one in its header; a .tri file has to be read through
+    static bool readBounds(const char *file, Point &lo, Point &hi) {
+        if(isBinary(file)) {
+            TribHeader header;
+            std::ifstream in(file, std::ios::binary);
+            in.read((char *)&header, sizeof(header));
+            if(!in.good() || header.version != TRIB_VERSION) return false;
+
+            lo = Point(header.min[0], header.min[1], header.min[2]);
+            hi = Point(header.max[0], header.max[1], header.max[2]);
+            return true;
+        }
+
+        std::ifstream in(file);
+        int n;
+        in >> n;
+        if(in.fail() || n <= 0) return false;
+
+        lo = Point(FLT_MAX, FLT_MAX, FLT_MAX);
+        hi = Point(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        for(int i = 0; i < 3 * n; ++i) {
+            Point p;
+            in >> p.x >> p.y >> p.z;
+            if(in.fail()) return false;
+
+            lo = Point(MIN(lo.x, p.x), MIN(lo.y, p.y), MIN(lo.z, p.z));
+            hi = Point(MAX(hi.x, p.x), MAX(hi.y, p.y), MAX(hi.z, p.z));
+        }
+        return true;
+    }
+
+    // Whether the file starts like one init() can load, going no further
+    // than a .trib header or a .tri file's first triangle
+    static bool looksLoadable(const char *file) {
+        Point lo, hi;
+        if(isBinary(file)) return readBounds(file, lo, hi);
+
+        std::ifstream in(file);
+        int n;
+        in >> n;
+        if(in.fail() || n <= 0) return false;
+
+        GLfloat coord;
+        for(int i = 0; i < 9; ++i) {
+            in >> coord;
+        }
+        return !in.fail();
+    }
+
+    // Writes the terrain out as a .trib file that init() can map directly
+    bool save(const char *file) {
+        vector<Point> decoded;
+        if(qvertices) {
+            decoded.resize(n_vertices);
+            for(int i = 0; i < n_vertices; ++i) {
+                decoded[i] = vertex(i);
+            }
+        }
+
+        Point lo, hi;
+        return writeTrib(file, qvertices ? &decoded[0] : vertices, n_vertices,
+                         indices, n_triangles, lo, hi);
+    }
+
+    // Cuts the terrain into a per_side x per_side grid of .trib tiles in
+    // dir, each triangle going to the tile its centroid falls in, and
+    // writes an index of them that TerrainSet::init() reads
+    bool split(const char *dir, int per_side) {
+        mkdir(dir, 0777);
+        string base(dir);
+        std::ofstream index((base + "/" + TILE_INDEX).c_str());
+        index << per_side << endl;
+        index << min_coords.x << " " << min_coords.y << " " << min_coords.z << " "
+              << max_coords.x << " " << max_coords.y << " " << max_coords.z << endl;
+
+        // Bucket the triangles by tile, tile k holding tile_tris[tile_start[k]]
+        // up to tile_tris[tile_start[k+1]]
+        int n_tiles = per_side * per_side;
+        GLfloat tile_w = MAX(max_coords.x - min_coords.x, FLT_MIN) / per_side;
+        GLfloat tile_h = MAX(max_coords.y - min_coords.y, FLT_MIN) / per_side;
+        vector<int> tile_of(n_triangles);
+        vector<int> tile_start(n_tiles + 1, 0);
+        for(int t = 0; t < n_triangles; ++t) {
+            Triangle tri = triangle(t);
+            GLfloat cx = (tri.v1.x + tri.v2.x + tri.v3.x) / 3;
+            GLfloat cy = (tri.v1.y + tri.v2.y + tri.v3.y) / 3;
+            int i = MIN((int)((cx - min_coords.x) / tile_w), per_side-1);
+            int j = MIN((int)((cy - min_coords.y) / tile_h), per_side-1);
+            tile_of[t] = j * per_side + i;
+            tile_start[tile_of[t] + 1]++;
+        }
+        for(int k = 0; k < n_tiles; ++k) {
+            tile_start[k+1] += tile_start[k];
+        }
+        vector<int> tile_tris(n_triangles);
+        vector<int> fill(tile_start.begin(), tile_start.end() - 1);
+        for(int t = 0; t < n_triangles; ++t) {
+            tile_tris[fill[tile_of[t]]++] = t;
+        }
+
+        // Each tile numbers its own vertices in the order it first meets them
+        vector<int> local(n_vertices, -1);
+        for(int k = 0; k < n_tiles; ++k) {
+            if(tile_start[k] == tile_start[k+1]) {
+                index << "-" << endl;
+                continue;
+            }
+
+            vector<GLuint> used;
+            vector<Point> tile_vertices;
+            vector<GLuint> tile_indices;
+            for(int i = tile_start[k]; i < tile_start[k+1]; ++i) {
+                for(int c = 0; c < 3; ++c) {
+                    GLuint v = indices[3*tile_tris[i] + c];
+                    if(local[v] < 0) {
+                        local[v] = tile_vertices.size();
+                        used.push_back(v);
+                        tile_vertices.push_back(vertex(v));
+                    }
+                    tile_indices.push_back(local[v]);
+                }
+            }
+            for(size_t i = 0; i < used.size(); ++i) {
+                local[used[i]] = -1;
+            }
+
+            char name[64];
+            snprintf(name, sizeof(name), "tile_%d_%d.trib", k % per_side, k / per_side);
+            Point lo, hi;
+            if(!writeTrib((base + "/" + name).c_str(), &tile_vertices[0], tile_vertices.size(),
+                          &tile_indices[0], tile_indices.size() / 3, lo, hi)) {
+                return false;
+            }
+            index << name << " " << lo.x << " " << lo.y << " " << lo.z << " "
+                  << hi.x << " " << hi.y << " " << hi.z << endl;
+        }
+        return index.good();
+    }
+
+    // Bytes of memory the terrain holds on to, GPU copies aside
+    size_t memoryUsage() {
+        size_t bytes = mapping_size;
+        if(!mapping) {
+            bytes += sizeof(Point) * (vertices ? n_vertices : 0) +
+                     sizeof(GLuint) * 3 * n_triangles;
+        }
+        if(qvertices) bytes += sizeof(QPoint) * n_vertices;
+        if(eqs) bytes += sizeof(TriangleEq) * n_triangles;
+        bytes += sizeof(int) * (cell_start.size() + cell_tris.size() + neighbors.size());
+        bytes += sizeof(BVHNode) * bvh.size() + sizeof(int) * bvh_tris.size();
+        bytes += sizeof(GLfloat) * 12 * cell_soa.z[0].size();
+        bytes += sizeof(TerrainChunk) * chunks.size() + sizeof(GLuint) * chunk_indices.size();
+        bytes += sizeof(GLfloat) * (hm_z.size() + hm_lo.size() + hm_hi.size() + tri_error.size());
+        for(int l = 1; l < LOD_LEVELS; ++l) {
+            if(levels[l]) bytes += levels[l]->memoryUsage();
+        }
+        return bytes;
+    }
+
+    // Store vertices quantized to 16 bits from the next init() on. Meant for
+    // terrains too big to keep otherwise; queries get slower
+    void setCompact(bool c) {
+        compact = c;
+    }
+
+    // Keep what init() and buildHeightmap() build in dir from now on, and
+    // map it back in rather than build it again when it is there
+    void setCacheDir(const string &dir) {
+        cache_dir = dir;
+    }
+
+    GLfloat height(Point &p) {
+        int t = locate(p);
+        if(t < 0) return FLT_MAX;
+
+        TriangleEq scratch;
+        return p.z - equation(t, scratch).height(p.x, p.y);
+    }
+
+    // Same as height() but starts looking from wherever the cursor's last
+    // query landed, which is nearly free for closely spaced samples
+    GLfloat height(Point &p, TerrainCursor &cursor) {
+        int t = walk(p, cursor.tri);
+        if(t < 0) return FLT_MAX;
+
+        cursor.tri = t;
+        TriangleEq scratch;
+        return p.z - equation(t, scratch).height(p.x, p.y);
+    }
+
+    // Batched height(): out[i] is the height of pts[i] above the terrain or
+    // FLT_MAX if it is off the terrain
+    void heights(const Point *pts, size_t n, float *out) {
+        for(size_t i = 0; i < n; ++i) {
+            const Point &p = pts[i];
+            if(grid_w == 0 || p.x < min_coords.x || p.x > max_coords.x ||
+                    p.y < min_coords.y || p.y > max_coords.y) {
+                out[i] = FLT_MAX;
+                continue;
+            }
+
+            if(!eqs) {
+                Point q = p;
+                out[i] = height(q);
+                continue;
+            }
+
+            int c = cellY(p.y) * grid_w + cellX(p.x);
+            out[i] = bucketHeight(p, cell_start[c], cell_start[c+1]);
+        }
+    }
+
+    // Rasterizes the terrain with nodes step apart, so that heightApprox()
+    // and clears() can mostly skip the exact query
+    void buildHeightmap(GLfloat step) {
+        string cache = cache_key ? cacheFile(cache_dir, hashBytes(&step, sizeof(step), cache_key), "hm") : "";
+        if(!cache.empty() && loadHeightmap(cache, step)) return;
+
+        hm_step = step;
+        hm_w = (int)((max_coords.x - min_coords.x) / step) + 2;
+        hm_h = (int)((max_coords.y - min_coords.y) / step) + 2;
+        hm_z.assign(hm_w * hm_h, FLT_MAX);
+        hm_lo.assign((hm_w-1) * (hm_h-1), FLT_MAX);
+        hm_hi.assign((hm_w-1) * (hm_h-1), -FLT_MAX);
+
+        // A row of nodes at a time through the batched query
+        parallelFor(hm_h, [&](int j) {
+            vector<Point> row(hm_w);
+            vector<float> h(hm_w);
+            for(int i = 0; i < hm_w; ++i) {
+                row[i] = Point(min_coords.x + i * step, min_coords.y + j * step, 0);
+            }
+            heights(row.data(), hm_w, h.data());
+            for(int i = 0; i < hm_w; ++i) {
+                if(h[i] != FLT_MAX) hm_z[j * hm_w + i] = -h[i];
+            }
+        });
+
+        // Every triangle's z range counts for each cell its bounding box
+        // touches, which can only widen the bounds. The triangles are
+        // bucketed once by the rows of cells they cross, then rows are
+        // independent, so each thread takes a row and its bucket
+        int rows = hm_h-1;
+        auto rowOf = [&](GLfloat y) {
+            return MIN(MAX((int)((y - min_coords.y) / step), 0), rows-1);
+        };
+        vector<int> row_start(rows + 1, 0);
+        for(int t = 0; t < n_triangles; ++t) {
+            Triangle tri = triangle(t);
+            for(int j = rowOf(tri.minY()); j <= rowOf(tri.maxY()); ++j) row_start[j+1]++;
+        }
+        for(int j = 0; j < rows; ++j) {
+            row_start[j+1] += row_start[j];
+        }
+        vector<int> row_tris(row_start[rows]);
+        vector<int> next(row_start.begin(), row_start.end() - 1);
+        for(int t = 0; t < n_triangles; ++t) {
+            Triangle tri = triangle(t);
+            for(int j = rowOf(tri.minY()); j <= rowOf(tri.maxY()); ++j) row_tris[next[j]++] = t;
+        }
+
+        parallelFor(rows, [&](int j) {
+            GLfloat *lo = &hm_lo[j * (hm_w-1)];
+            GLfloat *hi = &hm_hi[j * (hm_w-1)];
+            for(int k = row_start[j]; k < row_start[j+1]; ++k) {
+                Triangle tri = triangle(row_tris[k]);
+                int i0 = MAX(0, (int)((tri.minX() - min_coords.x) / step));
+                int i1 = MIN(hm_w-2, (int)((tri.maxX() - min_coords.x) / step));
+                for(int i = i0; i <= i1; ++i) {
+                    lo[i] = MIN(lo[i], tri.minZ());
+                    hi[i] = MAX(hi[i], tri.maxZ());
+                }
+            }
+        });
+
+        if(!cache.empty() && !saveHeightmap(cache)) {
+            cerr << "Could not write heightmap cache " << cache << endl;
+        }
+    }
+
+    // Bilinear ground elevation at (x, y) from the heightmap, or FLT_MAX off
+    // the terrain. Exact when there is no heightmap
+    GLfloat heightApprox(GLfloat x, GLfloat y) {
+        if(hm_w == 0) {
+            Point p(x, y, 0);
+            GLfloat h = height(p);
+            return h == FLT_MAX ? FLT_MAX : -h;
+        }
+
+        GLfloat fx = (x - min_coords.x) / hm_step;
+        GLfloat fy = (y - min_coords.y) / hm_step;
+        if(fx < 0 || fy < 0 || fx > hm_w-1 || fy > hm_h-1) return FLT_MAX;
+
+        int i = MIN((int)fx, hm_w-2);
+        int j = MIN((int)fy, hm_h-2);
+        GLfloat s = fx - i;
+        GLfloat t = fy - j;
+        GLfloat *z = &hm_z[j * hm_w + i];
+        if(z[0] == FLT_MAX || z[1] == FLT_MAX || z[hm_w] == FLT_MAX || z[hm_w+1] == FLT_MAX)
+            return FLT_MAX;
+
+        return (1-t) * ((1-s) * z[0] + s * z[1]) + t * ((1-s) * z[hm_w] + s * z[hm_w+1]);
+    }
+
+    // Whether p is at least margin above the ground. The heightmap's bounds
+    // settle most points; the exact query only runs for the rest
+    bool clears(Point &p, GLfloat margin) {
+        if(hm_w > 0) {
+            int i = (int)((p.x - min_coords.x) / hm_step);
+            int j = (int)((p.y - min_coords.y) / hm_step);
+            if(i >= 0 && j >= 0 && i < hm_w-1 && j < hm_h-1) {
+                int c = j * (hm_w-1) + i;
+                GLfloat *z = &hm_z[j * hm_w + i];
+                if(p.z - hm_hi[c] >= margin) return true;
+
+                // Off the terrain counts as clear, so only say no where the
+                // whole cell is on it
+                if(p.z - hm_lo[c] < margin && z[0] != FLT_MAX && z[1] != FLT_MAX &&
+                        z[hm_w] != FLT_MAX && z[hm_w+1] != FLT_MAX) return false;
+            }
+        }
+
+        return height(p) >= margin;
+    }
+
+    // height() off by at most tolerance, from the coarsest level whose
+    // triangle under p is that close to this terrain. A level can reach a
+    // little past this terrain where its hull has notches
+    GLfloat heightWithin(Point &p, GLfloat tolerance) {
+        for(int l = LOD_LEVELS-1; l > 0; --l) {
+            if(!levels[l]) continue;
+
+            GLfloat error;
+            GLfloat h = levels[l]->coarseHeight(p, error);
+            if(h != FLT_MAX && error <= tolerance) return h;
+        }
+        return height(p);
+    }
+
+    // height() on a coarse level, with how far the finest terrain may be
+    // off it there
+    GLfloat coarseHeight(Point &p, GLfloat &error) {
+        int t = locate(p);
+        if(t < 0) return FLT_MAX;
+
+        error = tri_error[t];
+        TriangleEq scratch;
+        return p.z - equation(t, scratch).height(p.x, p.y);
+    }
+
+    // How far along origin + t*dir the ray first hits the terrain, or
+    // FLT_MAX if it never does
+    GLfloat raycast(const Point &origin, const Vector &dir) {
+        return intersect(origin, dir, 0, FLT_MAX, false);
+    }
+
+    // Whether the segment from a to b clears the terrain. Touching it right
+    // at either end does not count
+    bool lineOfSight(const Point &a, const Point &b) {
+        return intersect(a, b - a, LOS_EPSILON, 1 - LOS_EPSILON, true) == FLT_MAX;
+    }
+
+    // Lowest height above the terrain of the quadratic Bezier curve with
+    // control points p0, p1 and p2 between t0 and t1, or FLT_MAX if it is
+    // never over the terrain. Walks the triangles under the curve; over each
+    // the height is a quadratic in t, so its minimum there is exact
+    GLfloat clearance(const Point &p0, const Point &p1, const Point &p2,
+                      GLfloat t0, GLfloat t1, TerrainCursor &cursor) {
+        if(n_triangles == 0) return FLT_MAX;
+
+        // The curve is A*t^2 + B*t + C
+        double A[3] = { p0.x - 2*p1.x + p2.x, p0.y - 2*p1.y + p2.y, p0.z - 2*p1.z + p2.z };
+        double B[3] = { 2*(p1.x - p0.x), 2*(p1.y - p0.y), 2*(p1.z - p0.z) };
+        double C[3] = { p0.x, p0.y, p0.z };
+        auto at = [&](double s) {
+            return Point(C[0] + s*(B[0] + s*A[0]), C[1] + s*(B[1] + s*A[1]), C[2] + s*(B[2] + s*A[2]));
+        };
+
+        // Off the terrain, the curve is searched for a grid cell's length at
+        // a time. Its speed is linear in t, so one end has the most
+        double speed = MAX(hypot(B[0], B[1]), hypot(2*A[0] + B[0], 2*A[1] + B[1]));
+        double dt = speed > 0 ? MIN(cell_w, cell_h) / speed : t1 - t0;
+
+        TriangleEq scratch;
+        GLfloat best = FLT_MAX;
+        double t = t0;
+        Point p = at(t);
+        int tri = walk(p, cursor.tri);
+        int stalls = 0;
+        int idle = 0;
+        double moved = t;
+        while(true) {
+            // Anything that stops t from moving on, as ending exactly on an
+            // edge once did, would otherwise spin here for good. Past the
+            // limit the curve is nudged on as for a stall, or the walk ends
+            if(t > moved) {
+                moved = t;
+                idle = 0;
+            }
+            if(++idle > CURVE_MAX_IDLE) {
+                if(t >= t1) break;
+                t = MIN(t + CURVE_EPSILON, (double)t1);
+                p = at(t);
+                tri = locate(p);
+                continue;
+            }
+
+            if(tri < 0) {
+                if(t >= t1) break;
+                double next = MIN(t + dt, (double)t1);
+                tri = reenter(A, B, C, t, next);
+                if(tri < 0) t = next;
+                p = at(t);
+                continue;
+            }
+
+            // Rounding can leave the curve just outside the triangle it
+            // stepped into, or stuck turning about a vertex
+            const TriangleEq &eq = equation(tri, scratch);
+            if(!eq.inside(p.x, p.y) || stalls > CURVE_MAX_STALLS) {
+                if(stalls > CURVE_MAX_STALLS) {
+                    t = MIN(t + CURVE_EPSILON, (double)t1);
+                    p = at(t);
+                    stalls = 0;
+                }
+                tri = walk(p, tri);
+                continue;
+            }
+            cursor.tri = tri;
+
+            // Leaves through whichever edge's signed distance first turns
+            // negative. inside() allows a little slack, so it may already be
+            // on its way out
+            double t_out = t1;
+            int exit = -1;
+            for(int k = 0; k < 3; ++k) {
+                double q[3];
+                edgeQuadratic(eq.e[k], A, B, C, q);
+                if(q[2] + t*(q[1] + t*q[0]) <= 0 && 2*q[0]*t + q[1] < 0) {
+                    t_out = t;
+                    exit = k;
+                    break;
+                }
+
+                double roots[2];
+                int n = quadraticRoots(q, roots);
+                for(int i = 0; i < n; ++i) {
+                    double r = roots[i];
+                    if(r < t - CURVE_EPSILON || r >= t_out || 2*q[0]*r + q[1] >= 0) continue;
+                    t_out = MAX(r, t);
+                    exit = k;
+                }
+            }
+
+            // Height above the triangle's plane
+            double h[3] = { A[2] - eq.z[0]*A[0] - eq.z[1]*A[1],
+                            B[2] - eq.z[0]*B[0] - eq.z[1]*B[1],
+                            C[2] - eq.z[0]*C[0] - eq.z[1]*C[1] - eq.z[2] };
+            best = MIN(best, (GLfloat)(h[2] + t*(h[1] + t*h[0])));
+            best = MIN(best, (GLfloat)(h[2] + t_out*(h[1] + t_out*h[0])));
+            if(h[0] > 0) {
+                double v = -h[1] / (2*h[0]);
+                if(v > t && v < t_out) best = MIN(best, (GLfloat)(h[2] + v*(h[1] + v*h[0])));
+            }
+
+            // Ending on an edge, as curves between sites on vertices do,
+            // leaves nothing past it to cross into
+            if(exit < 0 || t_out >= t1) break;
+
+            stalls = t_out - t < CURVE_EPSILON ? stalls + 1 : 0;
+            t = t_out;
+            p = at(t);
+
+            tri = neighbors[3*tri+exit];
+
+            // Off the hull, or onto a triangle the mesh does not link up
+            // with. The grid usually knows which just past the edge
+            if(tri < 0 && t < t1) {
+                double s = MIN(t + CURVE_EPSILON, (double)t1);
+                Point past = at(s);
+                tri = locate(past);
+                if(tri >= 0) {
+                    t = s;
+                    p = past;
+                }
+            }
+        }
+        return best;
+    }
+
+    // Signed distance from edge e of the curve A*t^2 + B*t + C, as a
+    // quadratic in t
+    static void edgeQuadratic(const GLfloat e[3], const double A[3], const double B[3],
+                              const double C[3], double q[3]) {
+        q[0] = e[0]*A[0] + e[1]*A[1];
+        q[1] = e[0]*B[0] + e[1]*B[1];
+        q[2] = e[0]*C[0] + e[1]*C[1] + e[2];
+    }
+
+    // The triangle the curve A*t^2 + B*t + C first comes onto between t and
+    // t_end, no further than a grid cell, with t moved to where. -1 if none
+    int reenter(const double A[3], const double B[3], const double C[3],
+                double &t, double t_end) {
+        GLfloat x = C[0] + t*(B[0] + t*A[0]);
+        GLfloat y = C[1] + t*(B[1] + t*A[1]);
+        if(x < min_coords.x - cell_w || x > max_coords.x + cell_w ||
+                y < min_coords.y - cell_h || y > max_coords.y + cell_h) {
+            return -1;
+        }
+
+        TriangleEq scratch;
+        double first = t_end;
+        int found = -1;
+        int i0 = cellX(x), j0 = cellY(y);
+        for(int j = MAX(0, j0-1); j <= MIN(j0+1, grid_h-1); ++j) {
+            for(int i = MAX(0, i0-1); i <= MIN(i0+1, grid_w-1); ++i) {
+                int c = j * grid_w + i;
+                for(int k = cell_start[c]; k < cell_start[c+1]; ++k) {
+                    const TriangleEq &eq = equation(cell_tris[k], scratch);
+
+                    // It comes on either where it starts or across an edge
+                    double q[3][3], candidates[7];
+                    int n = 0;
+                    candidates[n++] = t;
+                    for(int e = 0; e < 3; ++e) {
+                        edgeQuadratic(eq.e[e], A, B, C, q[e]);
+                        n += quadraticRoots(q[e], candidates + n);
+                    }
+
+                    for(int m = 0; m < n; ++m) {
+                        double s = candidates[m];
+                        if(s < t || s >= first) continue;
+
+                        // Over it, and not on the way straight back off
+                        bool over = true;
+                        for(int e = 0; e < 3 && over; ++e) {
+                            double d = q[e][2] + s*(q[e][1] + s*q[e][0]);
+                            over = d >= -EDGE_TOLERANCE &&
+                                   !(d < EDGE_TOLERANCE && 2*q[e][0]*s + q[e][1] < 0);
+                        }
+                        if(over) {
+                            first = s;
+                            found = cell_tris[k];
+                        }
+                    }
+                }
+            }
+        }
+
+        if(found >= 0) t = first;
+        return found;
+    }
+
+    // Index of the triangle containing p, or -1 if p is off the terrain
+    int locate(Point &p) {
+        if(grid_w == 0 || p.x < min_coords.x || p.x > max_coords.x ||
+                p.y < min_coords.y || p.y > max_coords.y) {
+            return -1;
+        }
+
+        GLfloat slack = edgeSlack(p);
+        TriangleEq scratch;
+        int c = cellY(p.y) * grid_w + cellX(p.x);
+        for(int i = cell_start[c]; i < cell_start[c+1]; i++) {
+            if(contains(cell_tris[i], equation(cell_tris[i], scratch), p, slack)) {
+                return cell_tris[i];
+            }               
+        } 
+
+        // Inside the bounding box but outside the convex hull
+        return -1; 
+    }
+
+    // Largest rounding error of a TriangleEq edge value at p. The
+    // coefficients and terms are each within a few float ulps of the
+    // coordinates' magnitude
+    GLfloat edgeSlack(const Point &p) {
+        GLfloat x = MAX(MAX(fabsf(min_coords.x), fabsf(max_coords.x)), fabsf(p.x));
+        GLfloat y = MAX(MAX(fabsf(min_coords.y), fabsf(max_coords.y)), fabsf(p.y));
+        return EDGE_FILTER * (x + y);
+    }
+
+    // Whether p is on the inner side of edge k of triangle t. The float edge
+    // value decides unless it is within slack of zero, and then leftTurn()
+    // does exactly, so that of two triangles sharing the edge p is in one.
+    // Nothing shares a hull edge, and a point right on one is on the terrain
+    bool insideEdge(int t, const TriangleEq &eq, int k, const Point &p, GLfloat slack) {
+        GLfloat d = eq.edge(k, p.x, p.y);
+        if(d > slack) return true;
+        if(d < -slack || (eq.e[k][0] == 0 && eq.e[k][1] == 0)) return false;
+
+        GLuint a = indices[3*t+k];
+        GLuint b = indices[3*t+(k+1)%3];
+        if(neighbors.empty() || neighbors[3*t+k] < 0) return orientSign(vertex(a), vertex(b), p) >= 0;
+        return leftTurn(vertex(a), a, vertex(b), b, p, QUERY_INDEX);
+    }
+
+    bool contains(int t, const TriangleEq &eq, const Point &p, GLfloat slack) {
+        return insideEdge(t, eq, 0, p, slack) && insideEdge(t, eq, 1, p, slack) &&
+               insideEdge(t, eq, 2, p, slack);
+    }
+
+    // Steps across shared edges from triangle start towards p
+    int walk(Point &p, int start) {
+        if(start < 0 || start >= n_triangles) return locate(p);
+
+        GLfloat slack = edgeSlack(p);
+        TriangleEq scratch;
+        int t = start;
+        for(int step = 0; step < WALK_MAX_STEPS; ++step) {
+            const TriangleEq &eq = equation(t, scratch);
+            int exit = -1;
+            for(int k = 0; k < 3; ++k) {
+                if(!insideEdge(t, eq, k, p, slack)) {
+                    exit = k;
+                    break;
+                }
+            }
+
+            if(exit < 0) return t;
+
+            t = neighbors[3*t+exit];
+
+            // Walked off the hull. It may not be convex, so let the grid decide
+            if(t < 0) return locate(p);
+        }
+
+        return locate(p);
+    }
+
+    // Draws only the chunks inside the frustum, each as coarse as it can be
+    // without its error showing. pixel_scale is how many pixels tall
+    // something one unit tall at distance one is
+    void draw(const Frustum &frustum, const Point &eye, GLfloat pixel_scale) {
+        if(n_triangles == 0) return;
+        if(buffers_dirty) upload();
+        if(ramp_dirty) uploadRamp();
+
+        vector<GLsizei> counts;
+        vector<const GLvoid *> offsets;
+        for(size_t c = 0; c < chunks.size(); ++c) {
+            TerrainChunk &chunk = chunks[c];
+            if(!frustum.intersects(chunk.min, chunk.max)) continue;
+
+            GLfloat dx = MAX(MAX(chunk.min.x - eye.x, eye.x - chunk.max.x), 0.0f);
+            GLfloat dy = MAX(MAX(chunk.min.y - eye.y, eye.y - chunk.max.y), 0.0f);
+            GLfloat dz = MAX(MAX(chunk.min.z - eye.z, eye.z - chunk.max.z), 0.0f);
+            GLfloat dist = sqrt(dx*dx + dy*dy + dz*dz);
+
+            int level = 0;
+            while(level < LOD_LEVELS-1 &&
+                    chunk.error[level+1] * pixel_scale <= LOD_PIXEL_ERROR * dist) {
+                level++;
+            }
+
+            counts.push_back(chunk.count[level]);
+            offsets.push_back((const GLvoid *)(sizeof(GLuint) * chunk.first[level]));
+        }
+        if(counts.empty()) return;
+
+        // The ramp coordinate is the relative elevation, generated from
+        // each vertex's object space z. Lighting then modulates it
+        GLfloat range = MAX(color_hi - color_lo, FLT_MIN);
+        GLfloat plane[4] = {0, 0, 1 / range, -color_lo / range};
+        if(qvertices) {
+            plane[2] = q_step.z / range;
+            plane[3] = (q_origin.z - color_lo) / range;
+        }
+        glEnable(GL_TEXTURE_1D);
+        glBindTexture(GL_TEXTURE_1D, texture);
+        glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+        glTexGeni(GL_S, GL_TEXTURE_GEN_MODE, GL_OBJECT_LINEAR);
+        glTexGenfv(GL_S, GL_OBJECT_PLANE, plane);
+        glEnable(GL_TEXTURE_GEN_S);
+        glColor3f(1.0, 1.0, 1.0);
+
+        glPushMatrix();
+        glEnableClientState(GL_VERTEX_ARRAY);
+
+        glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+        if(qvertices) {
+            // Let the modelview matrix decode the 16-bit positions. Its
+            // scale is per axis, so the normal has to be renormalized or
+            // the lighting comes out 1/q_step.z too bright
+            glEnable(GL_NORMALIZE);
+            glTranslatef(q_origin.x, q_origin.y, q_origin.z);
+            glScalef(q_step.x, q_step.y, q_step.z);
+            glVertexPointer(3, GL_SHORT, sizeof(QPoint), 0);
+        } else {
+            glVertexPointer(3, GL_FLOAT, sizeof(Point), 0);
+        }
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+
+        glMultiDrawElements(GL_TRIANGLES, &counts[0], GL_UNSIGNED_INT,
+                            &offsets[0], counts.size());
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        glPopMatrix();
+        glDisable(GL_NORMALIZE);
+
+        glDisable(GL_TEXTURE_GEN_S);
+        glDisable(GL_TEXTURE_1D);
+        checkError();
+    }
+
+    // Stretches the color ramp over elevations lo to hi instead of the
+    // terrain's own range, so that neighbouring tiles shade alike
+    void setColorRange(GLfloat lo, GLfloat hi) {
+        color_lo = lo;
+        color_hi = hi;
+    }
+
+    // Replaces the color ramp with rows of {relative height, r, g, b} laid
+    // out like colors. Only the ramp texture needs redoing
+    void setRamp(const GLfloat r[6][4]) {
+        memcpy(ramp, r, sizeof(ramp));
+        ramp_dirty = true;
+    }
+
+    
+    void setElevationColor(GLfloat elevation) {
+        GLfloat rgb[3];
+        elevationColor(elevation, rgb);
+        glColor3fv(rgb);
+    }
+
+    void elevationColor(GLfloat elevation, GLfloat *rgb) {
+        GLfloat relative_height = (elevation - color_lo) / (color_hi - color_lo);
+        rampColor(relative_height, rgb);
+    }
+
+    void rampColor(GLfloat relative_height, GLfloat *rgb) {
+        if(relative_height < ramp[0][0]) {
+            memcpy(rgb, ramp[0]+1, 3 * sizeof(GLfloat));
+        } else if(relative_height < ramp[1][0]) {
+            setColor(1, relative_height, rgb);
+        } else if(relative_height < ramp[2][0]) {
+            setColor(2, relative_height, rgb);
+        } else if(relative_height < ramp[3][0]) {
+            setColor(3, relative_height, rgb);
+        } else if(relative_height < ramp[4][0]) {
+            setColor(4, relative_height, rgb);
+        } else {
+            memcpy(rgb, ramp[5]+1, 3 * sizeof(GLfloat));
+        }
+    }
+
+    void setColor(int i, GLfloat relative_height, GLfloat *rgb) {
+        GLfloat s = (relative_height-ramp[i-1][0]) / (ramp[i][0] - ramp[i-1][0]);
+        rgb[0] = lerp(ramp[i][1],ramp[i+1][1],s);
+        rgb[1] = lerp(ramp[i][2],ramp[i+1][2],s);
+        rgb[2] = lerp(ramp[i][3],ramp[i+1][3],s);
+    }
+
+    Point vertex(int i) {
+        if(qvertices) {
+            return Point(q_origin.x + qvertices[i].x * q_step.x,
+                         q_origin.y + qvertices[i].y * q_step.y,
+                         q_origin.z + qvertices[i].z * q_step.z);
+        }
+        return vertices[i];
+    }
+
+    Triangle triangle(int i) {
+        Triangle t;
+        t.v1 = vertex(indices[3*i]);
+        t.v2 = vertex(indices[3*i+1]);
+        t.v3 = vertex(indices[3*i+2]);
+        return t;
+    }
+
+    int numTriangles() {
+        return n_triangles;
+    }
+
+    int numVertices() {
+        return n_vertices;
+    }
+    Point getMaxCoords() {
+        return max_coords;
+    }
+  
+    Point getMinCoords() {
+        return min_coords; 
+    }
+
+    static const GLfloat colors[6][4];
+
+private:
+
+    // Reads file and builds everything init() promises from it
+    bool build(const char *file, ParseCallback parsed) {
+        if(isBinary(file)) {
+            if(!mapBinary(file)) return false;
+            if(parsed) {
+                vector<Point> corners;
+                for(int first = 0; first < n_triangles; first += PREVIEW_TRIANGLES) {
+                    int n = MIN(PREVIEW_TRIANGLES, n_triangles - first);
+                    corners.resize(3 * n);
+                    for(int i = 0; i < 3 * n; ++i) {
+                        corners[i] = vertices[indices[3 * first + i]];
+                    }
+                    parsed(&corners[0], n);
+                }
+            }
+        } else {
+            if(!readText(file, parsed)) return false;
+            findBounds();
+
+            // save() and split() write .trib files out already in order
+            reorder();
+        }
+
+        if(compact) {
+            quantize();
+        }
+
+        if(!buildEquations()) {
+            return false;
+        }
+
+        // The grid and the BVH need only the equations, so they are built
+        // alongside the adjacency. The chunks need both the adjacency and,
+        // to measure the coarse levels against this one, the grid
+        thread grid_builder(&Terrain::buildGrid, this);
+        thread bvh_builder(&Terrain::buildBVH, this);
+        buildAdjacency();
+        grid_builder.join();
+        buildChunks();
+        bvh_builder.join();
+        return true;
+    }
+
+    void release() {
+        if(mapping) {
+            munmap(mapping, mapping_size);
+        } else {
+            free(vertices);
+            free(indices);
+        }
+        free(qvertices);
+        mapping = NULL;
+        vertices = NULL;
+        indices = NULL;
+        qvertices = NULL;
+        n_vertices = 0;
+        n_triangles = 0;
+    }
+
+    static bool isBinary(const char *file) {
+        char magic[4] = {0};
+        std::ifstream in(file, std::ios::binary);
+        in.read(magic, 4);
+        return in.good() && memcmp(magic, TRIB_MAGIC, 4) == 0;
+    }
+
+    // Writes n_vertices vertices and n_triangles triangles in the .trib
+    // layout, passing back their bounding box
+    static bool writeTrib(const char *file, const Point *verts, int nv,
+                          const GLuint *idx, int nt, Point &lo, Point &hi) {
+        lo = Point(FLT_MAX, FLT_MAX, FLT_MAX);
+        hi = Point(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        for(int i = 0; i < nv; ++i) {
+            lo.x = MIN(lo.x, verts[i].x);
+            lo.y = MIN(lo.y, verts[i].y);
+            lo.z = MIN(lo.z, verts[i].z);
+            hi.x = MAX(hi.x, verts[i].x);
+            hi.y = MAX(hi.y, verts[i].y);
+            hi.z = MAX(hi.z, verts[i].z);
+        }
+
+        TribHeader header;
+        memcpy(header.magic, TRIB_MAGIC, 4);
+        header.version = TRIB_VERSION;
+        header.n_vertices = nv;
+        header.n_triangles = nt;
+        header.min[0] = lo.x;
+        header.min[1] = lo.y;
+        header.min[2] = lo.z;
+        header.max[0] = hi.x;
+        header.max[1] = hi.y;
+        header.max[2] = hi.z;
+
+        std::ofstream out(file, std::ios::binary);
+        out.write((char *)&header, sizeof(header));
+        out.write((char *)verts, sizeof(Point) * nv);
+        out.write((char *)idx, sizeof(GLuint) * 3 * nt);
+        return out.good();
+    }
+
+    // Maps a .trib file and uses it in place, so there is nothing to parse
+    bool mapBinary(const char *file) {
+        int fd = open(file, O_RDONLY);
+        if(fd < 0) return false;
+
+        struct stat st;
+        if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TribHeader)) {
+            close(fd);
+            return false;
+        }
+
+        void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if(base == MAP_FAILED) return false;
+
+        // The counts have to fit the ints they are kept in, three indices a
+        // triangle included, and every index has to name a vertex, or a
+        // damaged file would be read out of bounds later on
+        TribHeader *header = (TribHeader *)base;
+        bool good = header->version == TRIB_VERSION && header->n_vertices <= INT_MAX &&
+                    header->n_triangles <= INT_MAX / 3;
+        size_t expected = sizeof(TribHeader) + sizeof(Point) * (uint64_t)header->n_vertices +
+                          sizeof(GLuint) * 3 * (uint64_t)header->n_triangles;
+        good = good && (size_t)st.st_size >= expected;
+        const GLuint *index = (const GLuint *)((Point *)(header + 1) + header->n_vertices);
+        for(size_t i = 0; good && i < 3 * (size_t)header->n_triangles; ++i) {
+            good = index[i] < header->n_vertices;
+        }
+        if(!good) {
+            munmap(base, st.st_size);
+            return false;
+        }
+
+        mapping = base;
+        mapping_size = st.st_size;
+        n_vertices = header->n_vertices;
+        n_triangles = header->n_triangles;
+        vertices = (Point *)(header + 1);
+        indices = (GLuint *)(vertices + n_vertices);
+        min_coords = Point(header->min[0], header->min[1], header->min[2]);
+        max_coords = Point(header->max[0], header->max[1], header->max[2]);
+        return true;
+    }
+
+    // Hash of file's contents and of everything that changes what init()
+    // builds from them, or 0 if it cannot be read
+    uint64_t fileKey(const char *file) {
+        int fd = open(file, O_RDONLY);
+        if(fd < 0) return 0;
+
+        struct stat st;
+        if(fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return 0;
+        }
+        void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if(base == MAP_FAILED) return 0;
+
+        uint64_t key = hashBytes(base, st.st_size);
+        munmap(base, st.st_size);
+
+        uint64_t params[] = { CACHE_VERSION, (uint64_t)st.st_size, compact, TRIS_PER_CELL,
+                              CHUNK_TRIANGLES, LOD_LEVELS, BVH_LEAF_TRIANGLES,
+                              sizeof(TriangleEq), sizeof(BVHNode), sizeof(TerrainChunk) };
+        return hashBytes(params, sizeof(params), key);
+    }
+
+    bool saveCache(const string &file) {
+        return writeCacheFile(file, cache_key, [this](CacheWriter &out) { writeCache(out); });
+    }
+
+    // The vertices and indices are used where they lie in the mapping, like
+    // a .trib file's, and the rest is copied out so the mapping can shrink
+    // to just them
+    bool loadCache(const string &file) {
+        size_t size = 0;
+        void *base = mapCache(file, cache_key, size);
+        if(!base) return false;
+
+        mapping = base;
+        mapping_size = size;
+        CacheReader in(base, size, CacheReader::align(sizeof(CacheHeader)));
+        if(!readCache(in, true)) {
+            cerr << "Ignoring damaged terrain cache " << file << endl;
+            releaseLevels();
+            release();
+            free(eqs);
+            eqs = NULL;
+            return false;
+        }
+
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t used = (const char *)(indices + 3 * n_triangles) - (const char *)base;
+        if(vertices) used = MAX(used, (size_t)((const char *)(vertices + n_vertices) - (const char *)base));
+        used = (used + page - 1) / page * page;
+        if(used < size) {
+            munmap((char *)base + used, size - used);
+            mapping_size = used;
+        }
+        return true;
+    }
+
+    // Everything built from the file, then each coarser level the same way
+    void writeCache(CacheWriter &out) {
+        CacheCounts counts;
+        counts.n_vertices = n_vertices;
+        counts.n_triangles = n_triangles;
+        counts.quantized = qvertices != NULL;
+        counts.has_levels = levels[1] != NULL;
+        counts.min = min_coords;
+        counts.max = max_coords;
+        counts.q_origin = q_origin;
+        counts.q_step = q_step;
+        counts.grid_w = grid_w;
+        counts.grid_h = grid_h;
+        counts.cell_w = cell_w;
+        counts.cell_h = cell_h;
+        memcpy(counts.level_error, level_error, sizeof(level_error));
+        out.value(counts);
+
+        if(qvertices) {
+            out.section(qvertices, sizeof(QPoint) * n_vertices);
+        } else {
+            out.section(vertices, sizeof(Point) * n_vertices);
+        }
+        out.section(indices, sizeof(GLuint) * 3 * n_triangles);
+        out.section(eqs, eqs ? sizeof(TriangleEq) * n_triangles : 0);
+        out.array(cell_start);
+        out.array(cell_tris);
+        out.array(neighbors);
+        out.array(bvh);
+        out.array(bvh_tris);
+        out.array(chunks);
+        out.array(chunk_indices);
+        out.array(tri_error);
+        if(counts.has_levels) {
+            for(int l = 1; l < LOD_LEVELS; ++l) {
+                levels[l]->writeCache(out);
+            }
+        }
+    }
+
+    // Reverses writeCache(). With borrow the vertices and indices point into
+    // the mapping, otherwise they are copied out like everything else
+    bool readCache(CacheReader &in, bool borrow) {
+        CacheCounts counts;
+        if(!in.value(counts)) return false;
+        if(counts.n_vertices < 0 || counts.n_triangles < 0 || counts.grid_w < 0 || counts.grid_h < 0)
+            return false;
+
+        n_vertices = counts.n_vertices;
+        n_triangles = counts.n_triangles;
+        min_coords = counts.min;
+        max_coords = counts.max;
+        q_origin = counts.q_origin;
+        q_step = counts.q_step;
+        grid_w = counts.grid_w;
+        grid_h = counts.grid_h;
+        cell_w = counts.cell_w;
+        cell_h = counts.cell_h;
+
+        size_t bytes = 0;
+        const void *v = in.section(bytes);
+        size_t vertex_bytes = (counts.quantized ? sizeof(QPoint) : sizeof(Point)) * n_vertices;
+        if(!v || bytes != vertex_bytes) return false;
+        if(counts.quantized) {
+            qvertices = (QPoint *)malloc(MAX(bytes, 1));
+            memcpy(qvertices, v, bytes);
+        } else if(borrow) {
+            vertices = (Point *)v;
+        } else {
+            vertices = (Point *)malloc(MAX(bytes, 1));
+            memcpy(vertices, v, bytes);
+        }
+
+        const void *idx = in.section(bytes);
+        if(!idx || bytes != sizeof(GLuint) * 3 * n_triangles) return false;
+        if(borrow) {
+            indices = (GLuint *)idx;
+        } else {
+            indices = (GLuint *)malloc(MAX(bytes, 1));
+            memcpy(indices, idx, bytes);
+        }
+
+        free(eqs);
+        eqs = NULL;
+        const void *e = in.section(bytes);
+        if(!e || (bytes != 0 && bytes != sizeof(TriangleEq) * n_triangles)) return false;
+        if(bytes) {
+            if(posix_memalign((void**)&eqs, 64, bytes) != 0) {
+                eqs = NULL;
+                return false;
+            }
+            memcpy(eqs, e, bytes);
+        }
+
+        in.array(cell_start);
+        in.array(cell_tris);
+        in.array(neighbors);
+        in.array(bvh);
+        in.array(bvh_tris);
+        in.array(chunks);
+        in.array(chunk_indices);
+        in.array(tri_error);
+        if(!in.ok || cell_start.size() != (size_t)grid_w * grid_h + 1) return false;
+        if(!tri_error.empty() && tri_error.size() != (size_t)n_triangles) return false;
+        if(!consistent()) return false;
+        packBuckets();
+
+        releaseLevels();
+        memcpy(level_error, counts.level_error, sizeof(level_error));
+        if(counts.has_levels) {
+            for(int l = 1; l < LOD_LEVELS; ++l) {
+                levels[l] = new Terrain();
+                if(!levels[l]->readCache(in, false) ||
+                        levels[l]->tri_error.size() != (size_t)levels[l]->n_triangles) return false;
+            }
+        }
+        return true;
+    }
+
+    // Whether every index readCache() took in points inside the terrain, so
+    // that a damaged cache is turned away even when its sizes add up
+    bool consistent() {
+        for(int i = 0; i < 3 * n_triangles; ++i) {
+            if(indices[i] >= (GLuint)n_vertices) return false;
+        }
+
+        if(cell_start[0] != 0 || cell_start.back() != (int)cell_tris.size()) return false;
+        for(size_t c = 0; c + 1 < cell_start.size(); ++c) {
+            if(cell_start[c] > cell_start[c+1]) return false;
+        }
+        for(size_t i = 0; i < cell_tris.size(); ++i) {
+            if(cell_tris[i] < 0 || cell_tris[i] >= n_triangles) return false;
+        }
+
+        if(neighbors.size() != 3 * (size_t)n_triangles) return false;
+        for(size_t i = 0; i < neighbors.size(); ++i) {
+            if(neighbors[i] < -1 || neighbors[i] >= n_triangles) return false;
+        }
+
+        // The coarse levels have no hierarchy at all
+        if(bvh.empty() ? !bvh_tris.empty() :
+                bvh_tris.size() != (size_t)n_triangles ||
+                bvhShape(0, 0, n_triangles) != (int)bvh.size()) return false;
+        for(size_t i = 0; i < bvh_tris.size(); ++i) {
+            if(bvh_tris[i] < 0 || bvh_tris[i] >= n_triangles) return false;
+        }
+
+        for(size_t c = 0; c < chunks.size(); ++c) {
+            for(int level = 0; level < LOD_LEVELS; ++level) {
+                int first = chunks[c].first[level];
+                int count = chunks[c].count[level];
+                if(first < 0 || count < 0 || (size_t)first + count > chunk_indices.size()) return false;
+            }
+        }
+        for(size_t i = 0; i < chunk_indices.size(); ++i) {
+            if(chunk_indices[i] >= (GLuint)n_vertices) return false;
+        }
+        return true;
+    }
+
+    // Nodes under node if they are laid out as buildNode() lays out count
+    // triangles from bvh_tris[first] on, or -1 if they are not
+    int bvhShape(int node, int first, int count) {
+        if(node >= (int)bvh.size()) return -1;
+
+        const BVHNode &n = bvh[node];
+        if(count <= BVH_LEAF_TRIANGLES) return n.start == first && n.count == count ? 1 : -1;
+
+        int half = count / 2;
+        int left = bvhShape(node + 1, first, half);
+        if(left < 0 || n.count != 0 || n.start != node + 1 + left) return -1;
+
+        int right = bvhShape(n.start, first + half, count - half);
+        return right < 0 ? -1 : 1 + left + right;
+    }
+
+    bool saveHeightmap(const string &file) {
+        uint64_t key = hashBytes(&hm_step, sizeof(hm_step), cache_key);
+        return writeCacheFile(file, key, [this](CacheWriter &out) {
+            int32_t size[2] = { hm_w, hm_h };
+            out.value(size);
+            out.array(hm_z);
+            out.array(hm_lo);
+            out.array(hm_hi);
+        });
+    }
+
+    // The heightmap is small next to the rest, so it is simply copied out
+    bool loadHeightmap(const string &file, GLfloat step) {
+        uint64_t key = hashBytes(&step, sizeof(step), cache_key);
+        size_t size = 0;
+        void *base = mapCache(file, key, size);
+        if(!base) return false;
+
+        CacheReader in(base, size, CacheReader::align(sizeof(CacheHeader)));
+        int32_t dims[2];
+        in.value(dims);
+        in.array(hm_z);
+        in.array(hm_lo);
+        in.array(hm_hi);
+        munmap(base, size);
+        if(!in.ok || dims[0] < 2 || dims[1] < 2 || hm_z.size() != (size_t)dims[0] * dims[1] ||
+                hm_lo.size() != (size_t)(dims[0]-1) * (dims[1]-1) || hm_hi.size() != hm_lo.size()) {
+            hm_w = hm_h = 0;
+            return false;
+        }
+        hm_w = dims[0];
+        hm_h = dims[1];
+        hm_step = step;
+        return true;
+    }
+
+    bool readText(const char *file, ParseCallback parsed) {
+        std::ifstream in;
+        in.open(file);
+
+        // The total number of triangles will be the on the first line of the file
+        in >> n_triangles;
+        if(in.fail() || n_triangles < 0) return false;
+
+        n_vertices = 3 * n_triangles;
+        vertices = (Point*)malloc(sizeof(Point) * n_vertices);
+        indices = (GLuint*)malloc(sizeof(GLuint) * 3 * n_triangles);
+
+        int handed = 0;
+        for(int i = 0; i < n_vertices && in.good(); ++i) {
+            in >> vertices[i].x >> vertices[i].y >> vertices[i].z;
+            indices[i] = i;
+
+            int read = (i + 1) / 3;
+            if(parsed && !in.fail() && read > handed &&
+                    (read - handed == PREVIEW_TRIANGLES || i + 1 == n_vertices)) {
+                parsed(&vertices[3 * handed], read - handed);
+                handed = read;
+            }
+        }
+
+        if(in.fail()) {
+            return false;
+        }
+
+        orientTriangles();
+        weldVertices();
+        return true;
+    }
+
+    // Keep every triangle counter-clockwise so edge tests agree on sign
+    void orientTriangles() {
+        for(int i = 0; i < n_triangles; ++i) {
+            if(orient(vertices[indices[3*i]], vertices[indices[3*i+1]], vertices[indices[3*i+2]]) < 0)
+                swap(indices[3*i+1], indices[3*i+2]);
+        }
+    }
+
+    struct VertexOrder {
+        Point *vertices;
+
+        bool operator()(int a, int b) const {
+            Point &p = vertices[a];
+            Point &q = vertices[b];
+            if(p.x != q.x) return p.x < q.x;
+            if(p.y != q.y) return p.y < q.y;
+            return p.z < q.z;
+        }
+    };
+
+    // A .tri file repeats each site once for every triangle around it.
+    // Sorting brings the copies together so each can be kept just once
+    void weldVertices() {
+        vector<int> order(n_vertices);
+        for(int i = 0; i < n_vertices; ++i) {
+            order[i] = i;
+        }
+        VertexOrder less = { vertices };
+        sort(order.begin(), order.end(), less);
+
+        vector<GLuint> remap(n_vertices);
+        Point *welded = (Point*)malloc(sizeof(Point) * MAX(n_vertices, 1));
+        int n_welded = 0;
+        for(int i = 0; i < n_vertices; ++i) {
+            if(i == 0 || less(order[i-1], order[i])) {
+                welded[n_welded++] = vertices[order[i]];
+            }
+            remap[order[i]] = n_welded - 1;
+        }
+
+        for(int i = 0; i < 3 * n_triangles; ++i) {
+            indices[i] = remap[indices[i]];
+        }
+
+        free(vertices);
+        vertices = (Point*)realloc(welded, sizeof(Point) * MAX(n_welded, 1));
+        n_vertices = n_welded;
+    }
+
+    // Renumbers the vertices along a Z-order curve through their positions
+    // and the triangles along one through their centroids. A .tri file
+    // lists triangles in no useful order; this way triangles near each
+    // other on the ground are near each other in memory, for the grid,
+    // walks and index buffers alike
+    void reorder() {
+        GLfloat sx = 65535 / MAX(max_coords.x - min_coords.x, FLT_MIN);
+        GLfloat sy = 65535 / MAX(max_coords.y - min_coords.y, FLT_MIN);
+        auto key = [&](GLfloat x, GLfloat y) {
+            return (uint64_t)mortonKey((x - min_coords.x) * sx, (y - min_coords.y) * sy) << 32;
+        };
+
+        vector<uint64_t> order(n_vertices);
+        for(int i = 0; i < n_vertices; ++i) {
+            order[i] = key(vertices[i].x, vertices[i].y) | i;
+        }
+        radixSort(order);
+
+        vector<GLuint> remap(n_vertices);
+        Point *sorted = (Point*)malloc(sizeof(Point) * MAX(n_vertices, 1));
+        for(int i = 0; i < n_vertices; ++i) {
+            GLuint old = (GLuint)order[i];
+            sorted[i] = vertices[old];
+            remap[old] = i;
+        }
+        free(vertices);
+        vertices = sorted;
+
+        order.resize(n_triangles);
+        for(int t = 0; t < n_triangles; ++t) {
+            Point &a = vertices[remap[indices[3*t]]];
+            Point &b = vertices[remap[indices[3*t+1]]];
+            Point &c = vertices[remap[indices[3*t+2]]];
+            order[t] = key((a.x + b.x + c.x) / 3, (a.y + b.y + c.y) / 3) | t;
+        }
+        radixSort(order);
+
+        GLuint *renumbered = (GLuint*)malloc(sizeof(GLuint) * 3 * MAX(n_triangles, 1));
+        for(int t = 0; t < n_triangles; ++t) {
+            GLuint old = (GLuint)order[t];
+            for(int k = 0; k < 3; ++k) {
+                renumbered[3*t+k] = remap[indices[3*old+k]];
+            }
+        }
+        free(indices);
+        indices = renumbered;
+    }
+
+    // Now compute the max and min elevations which we'll need for our terrain shading
+    void findBounds() {
+        max_coords.x = INT_MIN;
+        max_coords.y = INT_MIN;
+        max_coords.z = INT_MIN;
+        min_coords.x = INT_MAX;
+        min_coords.y = INT_MAX;
+        min_coords.z = INT_MAX;
+
+        for(int i = 0; i < n_vertices; ++i) {
+            max_coords.x = MAX(max_coords.x, vertices[i].x);
+            max_coords.y = MAX(max_coords.y, vertices[i].y);
+            max_coords.z = MAX(max_coords.z, vertices[i].z);
+            min_coords.x = MIN(min_coords.x, vertices[i].x);
+            min_coords.y = MIN(min_coords.y, vertices[i].y);
+            min_coords.z = MIN(min_coords.z, vertices[i].z);
+        }
+    }
+
+    // Sends positions and indices to the GPU so that drawing is a single
+    // glMultiDrawElements
+    void upload() {
+        if(!vertex_buffer) {
+            glGenBuffers(1, &vertex_buffer);
+            glGenBuffers(1, &index_buffer);
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+        if(qvertices) {
+            glBufferData(GL_ARRAY_BUFFER, sizeof(QPoint) * n_vertices, qvertices, GL_STATIC_DRAW);
+        } else {
+            glBufferData(GL_ARRAY_BUFFER, sizeof(Point) * n_vertices, vertices, GL_STATIC_DRAW);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * chunk_indices.size(),
+                     &chunk_indices[0], GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+        buffers_dirty = false;
+        checkError();
+    }
+
+    // Replaces the float vertices with 16-bit offsets from the middle of the
+    // bounding box. Integer coordinates spanning less than 65536 (like our
+    // DEM lattice and its 1m vertical resolution) keep a step of 1 and lose
+    // nothing; anything else is spread over the full 16 bits. Each axis is
+    // judged on its own, so fractional heights leave x and y exact
+    void quantize() {
+        bool integral[3] = { true, true, true };
+        for(int i = 0; i < n_vertices; ++i) {
+            const Point &v = vertices[i];
+            integral[0] = integral[0] && v.x == floor(v.x);
+            integral[1] = integral[1] && v.y == floor(v.y);
+            integral[2] = integral[2] && v.z == floor(v.z);
+        }
+
+        Vector range = max_coords - min_coords;
+        for(int a = 0; a < 3; ++a) {
+            GLfloat r = a == 0 ? range.x : (a == 1 ? range.y : range.z);
+            GLfloat step = (integral[a] && r <= 65535) ? 1.0f : MAX(r, FLT_MIN) / 65535;
+            if(a == 0) q_step.x = step;
+            else if(a == 1) q_step.y = step;
+            else q_step.z = step;
+        }
+        q_origin = min_coords + 32768 * Vector(q_step);
+
+        qvertices = (QPoint*)malloc(sizeof(QPoint) * MAX(n_vertices, 1));
+        for(int i = 0; i < n_vertices; ++i) {
+            qvertices[i].x = lrint((vertices[i].x - q_origin.x) / q_step.x);
+            qvertices[i].y = lrint((vertices[i].y - q_origin.y) / q_step.y);
+            qvertices[i].z = lrint((vertices[i].z - q_origin.z) / q_step.z);
+        }
+
+        // Mapped vertices cost nothing once their pages are dropped
+        if(!mapping) free(vertices);
+        vertices = NULL;
+    }
+
+    // Precomputed unless the terrain is compact, in which case it is worked
+    // out into scratch from the decoded vertices
+    const TriangleEq &equation(int t, TriangleEq &scratch) {
+        if(eqs) return eqs[t];
+
+        Triangle tri = triangle(t);
+        scratch.set(tri);
+        return scratch;
+    }
+
+    // Bakes the color ramp into the 1D texture the terrain is drawn with
+    void uploadRamp() {
+        if(!texture) glGenTextures(1, &texture);
+
+        GLfloat texels[RAMP_TEXELS][3];
+        for(int i = 0; i < RAMP_TEXELS; ++i) {
+            rampColor((i + 0.5) / RAMP_TEXELS, texels[i]);
+        }
+
+        glBindTexture(GL_TEXTURE_1D, texture);
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexImage1D(GL_TEXTURE_1D, 0, GL_RGB, RAMP_TEXELS, 0, GL_RGB, GL_FLOAT, texels);
+        glBindTexture(GL_TEXTURE_1D, 0);
+
+        ramp_dirty = false;
+        checkError();
+    }
+
+    int cellX(GLfloat x) {
+        int i = (x - min_coords.x) / cell_w;
+        return MAX(0, MIN(i, grid_w-1));
+    }
+
+    int cellY(GLfloat y) {
+        int j = (y - min_coords.y) / cell_h;
+        return MAX(0, MIN(j, grid_h-1));
+    }
+
+    // Tests the bucketed triangles begin..end against p SIMD_WIDTH at a
+    // time, three multiply-adds each for the edges and one for the height.
+    // Reading past end only tests the next cell's triangles, which is
+    // harmless, and the arrays are padded with NaNs that never pass
+    GLfloat bucketHeight(const Point &p, int begin, int end) {
+        VF px = VSET(p.x);
+        VF py = VSET(p.y);
+        GLfloat slack = edgeSlack(p);
+        VF lo = VSET(-slack);
+        VF hi = VSET(slack);
+        const TriangleSoA &s = cell_soa;
+
+        // Lanes with every edge clear of the slack are certainly hits; any
+        // others that might be are settled one at a time by contains()
+#define VPLANE(c, i) VADD(VADD(VMUL(VLOAD(&c[0][i]), px), VMUL(VLOAD(&c[1][i]), py)), VLOAD(&c[2][i]))
+        for(int i = begin; i < end; i += SIMD_WIDTH) {
+            VF d0 = VPLANE(s.e[0], i);
+            VF d1 = VPLANE(s.e[1], i);
+            VF d2 = VPLANE(s.e[2], i);
+            int maybe = VMASK(VAND(VAND(VGE(d0, lo), VGE(d1, lo)), VGE(d2, lo)));
+            if(!maybe) continue;
+
+            int sure = VMASK(VAND(VAND(VGE(d0, hi), VGE(d1, hi)), VGE(d2, hi)));
+            GLfloat lanes[SIMD_WIDTH];
+            VSTORE(lanes, VPLANE(s.z, i));
+            for(; maybe; maybe &= maybe - 1) {
+                int l = __builtin_ctz(maybe);
+                int t = cell_tris[i + l];
+                if((sure >> l & 1) || contains(t, eqs[t], p, slack)) return p.z - lanes[l];
+            }
+        }
+#undef VPLANE
+
+        return FLT_MAX;
+    }
+
+    // Plane and edge coefficients for every triangle, in one block aligned
+    // to a cache line
+    bool buildEquations() {
+        free(eqs);
+        eqs = NULL;
+        if(compact) return true;
+
+        size_t bytes = sizeof(TriangleEq) * MAX(n_triangles, 1);
+        if(posix_memalign((void**)&eqs, 64, bytes) != 0) {
+            eqs = NULL;
+            return false;
+        }
+
+        for(int i = 0; i < n_triangles; ++i) {
+            Triangle tri = triangle(i);
+            eqs[i].set(tri);
+        }
+        return true;
+    }
+
+    // Splits the triangles into a grid of chunks by centroid and builds the
+    // coarser versions of each by vertex clustering: every vertex snaps to
+    // the highest vertex in its cluster and triangles that collapse are
+    // dropped. The simplified chunks only need new indices, not vertices,
+    // but each level is also built as a terrain of its own for queries
+    void buildChunks() {
+        chunks.clear();
+        chunk_indices.clear();
+        releaseLevels();
+        if(n_triangles == 0) return;
+
+        GLfloat width = MAX(max_coords.x - min_coords.x, 1.0f);
+        GLfloat depth = MAX(max_coords.y - min_coords.y, 1.0f);
+        GLfloat n = MAX(n_triangles / CHUNK_TRIANGLES, 1);
+        int chunks_w = MAX(1, (int)sqrt(n * width / depth));
+        int chunks_h = MAX(1, (int)(n / chunks_w));
+        GLfloat chunk_w = width / chunks_w;
+        GLfloat chunk_h = depth / chunks_h;
+
+        vector<vector<int> > members(chunks_w * chunks_h);
+        vector<int> chunk_of(n_triangles);
+        for(int i = 0; i < n_triangles; ++i) {
+            Triangle tri = triangle(i);
+            GLfloat x = (tri.v1.x + tri.v2.x + tri.v3.x) / 3.0;
+            GLfloat y = (tri.v1.y + tri.v2.y + tri.v3.y) / 3.0;
+            int cx = MIN((int)((x - min_coords.x) / chunk_w), chunks_w-1);
+            int cy = MIN((int)((y - min_coords.y) / chunk_h), chunks_h-1);
+            chunk_of[i] = cy * chunks_w + cx;
+            members[chunk_of[i]].push_back(i);
+        }
+
+        // Vertex spacing if they were spread evenly; the finest clusters are
+        // twice that
+        GLfloat spacing = sqrt(width * depth / MAX(n_vertices, 1));
+        vector<vector<int> > rep(LOD_LEVELS);
+        for(int level = 1; level < LOD_LEVELS; ++level) {
+            rep[level] = clusterVertices(spacing * (1 << level), chunk_of);
+            levels[level] = new Terrain();
+            levels[level]->coarsen(*this, rep[level]);
+
+            // Measured from the coarse triangle's side, so that each is
+            // only off as much as the terrain under it. Clustering can fold
+            // a triangle over, and one of those is never trusted
+            Terrain *coarse = levels[level];
+            coarse->tri_error.resize(coarse->n_triangles);
+            parallelFor(coarse->n_triangles, [&](int t) {
+                Triangle tri = coarse->triangle(t);
+                coarse->tri_error[t] = orient(tri.v1, tri.v2, tri.v3) > 0 ? gapTo(tri) : FLT_MAX;
+            });
+        }
+
+        vector<int> owner;
+        for(size_t c = 0; c < members.size(); ++c) {
+            if(members[c].empty()) continue;
+            owner.push_back(c);
+
+            TerrainChunk chunk;
+            chunk.min = Point(FLT_MAX, FLT_MAX, FLT_MAX);
+            chunk.max = Point(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+            for(int level = 0; level < LOD_LEVELS; ++level) {
+                chunk.first[level] = chunk_indices.size();
+                for(size_t m = 0; m < members[c].size(); ++m) {
+                    int t = members[c][m];
+                    GLuint v[3];
+                    for(int k = 0; k < 3; ++k) {
+                        v[k] = indices[3*t+k];
+                        if(level > 0) v[k] = rep[level][v[k]];
+                    }
+                    if(v[0] == v[1] || v[1] == v[2] || v[0] == v[2]) continue;
+
+                    for(int k = 0; k < 3; ++k) {
+                        Point p = vertex(v[k]);
+                        chunk.min = Point(MIN(chunk.min.x, p.x), MIN(chunk.min.y, p.y), MIN(chunk.min.z, p.z));
+                        chunk.max = Point(MAX(chunk.max.x, p.x), MAX(chunk.max.y, p.y), MAX(chunk.max.z, p.z));
+                        chunk_indices.push_back(v[k]);
+                    }
+                }
+                chunk.count[level] = chunk_indices.size() - chunk.first[level];
+            }
+            chunks.push_back(chunk);
+        }
+
+        // A level is as far off over a chunk as it is from the worst of the
+        // chunk's triangles
+        parallelFor(chunks.size(), [&](int c) {
+            vector<int> &tris = members[owner[c]];
+            chunks[c].error[0] = 0;
+            for(int level = 1; level < LOD_LEVELS; ++level) {
+                GLfloat gap = 0;
+                for(size_t m = 0; m < tris.size(); ++m) {
+                    Triangle tri = triangle(tris[m]);
+                    gap = MAX(gap, levels[level]->gapTo(tri));
+                }
+                chunks[c].error[level] = gap;
+            }
+        });
+        for(size_t c = 0; c < chunks.size(); ++c) {
+            for(int level = 1; level < LOD_LEVELS; ++level) {
+                level_error[level] = MAX(level_error[level], chunks[c].error[level]);
+            }
+        }
+    }
+
+    // Nodes in the hierarchy over n triangles. Splits always halve, so this
+    // settles where every subtree goes before any of them is built
+    static int bvhSize(int n) {
+        return n <= BVH_LEAF_TRIANGLES ? 1 : 1 + bvhSize(n/2) + bvhSize(n - n/2);
+    }
+
+    struct BVHTask {
+        int node;
+        int first;
+        int count;
+    };
+
+    // The top levels are split here and the subtrees below handed out to
+    // all the cores
+    void buildBVH() {
+        bvh.clear();
+        bvh_tris.resize(n_triangles);
+        if(n_triangles == 0) return;
+
+        vector<Point> lo(n_triangles), hi(n_triangles), mid(n_triangles);
+        parallelFor(n_triangles, [&](int t) {
+            Triangle tri = triangle(t);
+            lo[t] = Point(tri.minX(), tri.minY(), tri.minZ());
+            hi[t] = Point(tri.maxX(), tri.maxY(), tri.maxZ());
+            mid[t] = Point((lo[t].x + hi[t].x) / 2, (lo[t].y + hi[t].y) / 2,
+                           (lo[t].z + hi[t].z) / 2);
+            bvh_tris[t] = t;
+        });
+
+        bvh.resize(bvhSize(n_triangles));
+        vector<BVHTask> tasks;
+        BVHTask root = { 0, 0, n_triangles };
+        buildNode(root, 0, lo, hi, mid, &tasks);
+        parallelFor(tasks.size(), [&](int i) {
+            buildNode(tasks[i], BVH_SPLIT_DEPTH, lo, hi, mid, NULL);
+        });
+    }
+
+    // Splits at the median centroid along the widest axis. Subtrees at
+    // BVH_SPLIT_DEPTH go into tasks instead when there is a list to fill
+    void buildNode(BVHTask task, int depth, vector<Point> &lo, vector<Point> &hi,
+                   vector<Point> &mid, vector<BVHTask> *tasks) {
+        BVHNode &node = bvh[task.node];
+        Point mid_lo(FLT_MAX, FLT_MAX, FLT_MAX);
+        Point mid_hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        node.min = mid_lo;
+        node.max = mid_hi;
+        int *tris = &bvh_tris[task.first];
+        for(int i = 0; i < task.count; ++i) {
+            int t = tris[i];
+            node.min = Point(MIN(node.min.x, lo[t].x), MIN(node.min.y, lo[t].y), MIN(node.min.z, lo[t].z));
+            node.max = Point(MAX(node.max.x, hi[t].x), MAX(node.max.y, hi[t].y), MAX(node.max.z, hi[t].z));
+            mid_lo = Point(MIN(mid_lo.x, mid[t].x), MIN(mid_lo.y, mid[t].y), MIN(mid_lo.z, mid[t].z));
+            mid_hi = Point(MAX(mid_hi.x, mid[t].x), MAX(mid_hi.y, mid[t].y), MAX(mid_hi.z, mid[t].z));
+        }
+
+        if(task.count <= BVH_LEAF_TRIANGLES) {
+            node.start = task.first;
+            node.count = task.count;
+            return;
+        }
+
+        Vector extent = mid_hi - mid_lo;
+        int axis = extent.x >= extent.y ? (extent.x >= extent.z ? 0 : 2) : (extent.y >= extent.z ? 1 : 2);
+        int half = task.count / 2;
+        nth_element(tris, tris + half, tris + task.count, [&](int a, int b) {
+            return axis == 0 ? mid[a].x < mid[b].x :
+                   axis == 1 ? mid[a].y < mid[b].y : mid[a].z < mid[b].z;
+        });
+
+        node.start = task.node + 1 + bvhSize(half);
+        node.count = 0;
+        BVHTask left = { task.node + 1, task.first, half };
+        BVHTask right = { node.start, task.first + half, task.count - half };
+        if(tasks && depth + 1 == BVH_SPLIT_DEPTH) {
+            tasks->push_back(left);
+            tasks->push_back(right);
+        } else {
+            buildNode(left, depth + 1, lo, hi, mid, tasks);
+            buildNode(right, depth + 1, lo, hi, mid, tasks);
+        }
+    }
+
+    // Nearest hit along o + t*d with t_min <= t <= t_max, or with any set
+    // the first one found. Children are visited nearest first so that far
+    // ones can mostly be skipped
+    GLfloat intersect(const Point &o, const Vector &d, GLfloat t_min, GLfloat t_max, bool any) {
+        if(bvh.empty()) return FLT_MAX;
+
+        Vector inv(1 / d.x, 1 / d.y, 1 / d.z);
+        TriangleEq scratch;
+        GLfloat best = FLT_MAX;
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while(top > 0) {
+            int n = stack[--top];
+            const BVHNode &node = bvh[n];
+            if(rayBox(node.min, node.max, o, inv, t_min, MIN(t_max, best)) == FLT_MAX) continue;
+
+            if(node.count > 0) {
+                for(int i = node.start; i < node.start + node.count; ++i) {
+                    GLfloat t = equation(bvh_tris[i], scratch).rayHit(o, d);
+                    if(t < t_min || t > t_max || t >= best) continue;
+
+                    best = t;
+                    if(any) return best;
+                }
+                continue;
+            }
+
+            int near = n + 1;
+            int far = node.start;
+            GLfloat t_near = rayBox(bvh[near].min, bvh[near].max, o, inv, t_min, t_max);
+            GLfloat t_far = rayBox(bvh[far].min, bvh[far].max, o, inv, t_min, t_max);
+            if(t_far < t_near) {
+                swap(near, far);
+                swap(t_near, t_far);
+            }
+            if(t_far < best) stack[top++] = far;
+            if(t_near < best) stack[top++] = near;
+        }
+        return best;
+    }
+
+    void releaseLevels() {
+        for(int l = 1; l < LOD_LEVELS; ++l) {
+            delete levels[l];
+            levels[l] = NULL;
+            level_error[l] = 0;
+        }
+    }
+
+    // Makes this terrain fine with every vertex v moved onto rep[v], leaving
+    // out the triangles that collapse. The vertices are stored the way the
+    // fine terrain's are, and only what height queries need is built: no
+    // equations and no hierarchy for rays
+    void coarsen(Terrain &fine, const vector<int> &rep) {
+        release();
+        vector<int> local(fine.n_vertices, -1);
+        vector<int> kept;
+        vector<GLuint> tris;
+        for(int t = 0; t < fine.n_triangles; ++t) {
+            GLuint v[3];
+            for(int k = 0; k < 3; ++k) {
+                v[k] = rep[fine.indices[3*t+k]];
+            }
+            if(v[0] == v[1] || v[1] == v[2] || v[0] == v[2]) continue;
+
+            for(int k = 0; k < 3; ++k) {
+                if(local[v[k]] < 0) {
+                    local[v[k]] = kept.size();
+                    kept.push_back(v[k]);
+                }
+                tris.push_back(local[v[k]]);
+            }
+        }
+
+        n_vertices = kept.size();
+        n_triangles = tris.size() / 3;
+        if(fine.qvertices) {
+            q_origin = fine.q_origin;
+            q_step = fine.q_step;
+            qvertices = (QPoint*)malloc(sizeof(QPoint) * MAX(n_vertices, 1));
+            for(int i = 0; i < n_vertices; ++i) {
+                qvertices[i] = fine.qvertices[kept[i]];
+            }
+        } else {
+            vertices = (Point*)malloc(sizeof(Point) * MAX(n_vertices, 1));
+            for(int i = 0; i < n_vertices; ++i) {
+                vertices[i] = fine.vertices[kept[i]];
+            }
+        }
+        indices = (GLuint*)malloc(sizeof(GLuint) * MAX(3 * n_triangles, 1));
+        memcpy(indices, &tris[0], sizeof(GLuint) * 3 * n_triangles);
+        min_coords = fine.min_coords;
+        max_coords = fine.max_coords;
+
+        buildGrid();
+        buildAdjacency();
+    }
+
+    // Largest vertical gap between tri and this terrain over the part of tri
+    // it covers. Their difference is linear over each piece of tri that one
+    // of our triangles cuts out, so only the pieces' corners need checking
+    GLfloat gapTo(Triangle &tri) {
+        if(orient(tri.v1, tri.v2, tri.v3) <= 0) return 0;
+
+        TriangleEq fine;
+        fine.set(tri);
+        TriangleEq scratch;
+        GLfloat gap = 0;
+        int x0 = cellX(tri.minX());
+        int y0 = cellY(tri.minY());
+        for(int y = y0; y <= cellY(tri.maxY()); ++y) {
+            for(int x = x0; x <= cellX(tri.maxX()); ++x) {
+                int c = y * grid_w + x;
+                for(int i = cell_start[c]; i < cell_start[c+1]; ++i) {
+                    // Big triangles sit in several cells, so only look at
+                    // each in the first cell it shares with tri, and skip
+                    // it quickly if even the bounding boxes miss
+                    Triangle other = triangle(cell_tris[i]);
+                    if(MAX(cellX(other.minX()), x0) != x || MAX(cellY(other.minY()), y0) != y)
+                        continue;
+                    if(other.minX() > tri.maxX() + EDGE_TOLERANCE ||
+                            other.maxX() < tri.minX() - EDGE_TOLERANCE ||
+                            other.minY() > tri.maxY() + EDGE_TOLERANCE ||
+                            other.maxY() < tri.minY() - EDGE_TOLERANCE) continue;
+
+                    const TriangleEq &eq = equation(cell_tris[i], scratch);
+                    GLfloat poly[6][2];
+                    for(int k = 0; k < 3; ++k) {
+                        poly[k][0] = tri.vertex(k).x;
+                        poly[k][1] = tri.vertex(k).y;
+                    }
+
+                    int n = eq.clip(poly, 3);
+                    for(int k = 0; k < n; ++k) {
+                        GLfloat d = fine.height(poly[k][0], poly[k][1]) -
+                                    eq.height(poly[k][0], poly[k][1]);
+                        gap = MAX(gap, fabs(d));
+                    }
+                }
+            }
+        }
+        return gap;
+    }
+
+    // Maps each vertex to the highest vertex in its size x size cell. Those
+    // on the boundary, or between triangles in different chunks, stay put
+    // so that no seam opens up whatever level each side is drawn at
+    vector<int> clusterVertices(GLfloat size, const vector<int> &chunk_of) {
+        vector<bool> fixed(n_vertices, false);
+        for(int t = 0; t < n_triangles; ++t) {
+            for(int k = 0; k < 3; ++k) {
+                int across = neighbors[3*t+k];
+                if(across >= 0 && chunk_of[across] == chunk_of[t]) continue;
+                fixed[indices[3*t+k]] = true;
+                fixed[indices[3*t+(k+1)%3]] = true;
+            }
+        }
+
+        int cells_w = (int)((max_coords.x - min_coords.x) / size) + 1;
+        int cells_h = (int)((max_coords.y - min_coords.y) / size) + 1;
+        vector<int> cell(n_vertices);
+        vector<int> highest(cells_w * cells_h, -1);
+        for(int i = 0; i < n_vertices; ++i) {
+            if(fixed[i]) continue;
+
+            Point p = vertex(i);
+            cell[i] = (int)((p.y - min_coords.y) / size) * cells_w +
+                      (int)((p.x - min_coords.x) / size);
+            int &h = highest[cell[i]];
+            if(h < 0 || p.z > vertex(h).z) h = i;
+        }
+
+        vector<int> rep(n_vertices);
+        for(int i = 0; i < n_vertices; ++i) {
+            rep[i] = fixed[i] ? i : highest[cell[i]];
+        }
+        return rep;
+    }
+
+    struct HalfEdge {
+        GLfloat ax, ay, bx, by;
+        int slot;
+
+        bool operator<(const HalfEdge &o) const {
+            if(ax != o.ax) return ax < o.ax;
+            if(ay != o.ay) return ay < o.ay;
+            if(bx != o.bx) return bx < o.bx;
+            return by < o.by;
+        }
+
+        bool sameEdge(const HalfEdge &o) const {
+            return ax == o.ax && ay == o.ay && bx == o.bx && by == o.by;
+        }
+    };
+
+    // Match up the edges shared by two triangles. Sorting puts both halves
+    // of an edge next to each other
+    void buildAdjacency() {
+        vector<HalfEdge> edges(3 * n_triangles);
+        for(int t = 0; t < n_triangles; ++t) {
+            for(int k = 0; k < 3; ++k) {
+                Point a = vertex(indices[3*t+k]);
+                Point b = vertex(indices[3*t+(k+1)%3]);
+                if(b.x < a.x || (b.x == a.x && b.y < a.y)) swap(a, b);
+
+                HalfEdge &e = edges[3*t+k];
+                e.ax = a.x; e.ay = a.y;
+                e.bx = b.x; e.by = b.y;
+                e.slot = 3*t+k;
+            }
+        }
+        sort(edges.begin(), edges.end());
+
+        neighbors.assign(3 * n_triangles, -1);
+        for(int i = 0; i + 1 < (int)edges.size(); ++i) {
+            if(edges[i].sameEdge(edges[i+1])) {
+                neighbors[edges[i].slot] = edges[i+1].slot / 3;
+                neighbors[edges[i+1].slot] = edges[i].slot / 3;
+                ++i;
+            }
+        }
+    }
+
+    // Bucket every triangle into each grid cell its bounding box overlaps
+    void buildGrid() {
+        GLfloat width = MAX(max_coords.x - min_coords.x, 1.0f);
+        GLfloat depth = MAX(max_coords.y - min_coords.y, 1.0f);
+        GLfloat cells = MAX(n_triangles / TRIS_PER_CELL, 1);
+
+        // Keep cells roughly square whatever the aspect ratio of the terrain
+        grid_w = MAX(1, (int)sqrt(cells * width / depth));
+        grid_h = MAX(1, (int)(cells / grid_w));
+        cell_w = width / grid_w;
+        cell_h = depth / grid_h;
+
+        // Count first so the buckets can be packed into one array
+        cell_start.assign(grid_w * grid_h + 1, 0);
+        for(int i = 0; i < n_triangles; ++i) {
+            Triangle tri = triangle(i);
+            for(int y = cellY(tri.minY()); y <= cellY(tri.maxY()); ++y)
+                for(int x = cellX(tri.minX()); x <= cellX(tri.maxX()); ++x)
+                    cell_start[y * grid_w + x + 1]++;
+        }
+        for(int c = 0; c < grid_w * grid_h; ++c) {
+            cell_start[c+1] += cell_start[c];
+        }
+
+        vector<int> fill(cell_start.begin(), cell_start.end()-1);
+        cell_tris.resize(cell_start.back());
+        for(int i = 0; i < n_triangles; ++i) {
+            Triangle tri = triangle(i);
+            for(int y = cellY(tri.minY()); y <= cellY(tri.maxY()); ++y)
+                for(int x = cellX(tri.minX()); x <= cellX(tri.maxX()); ++x)
+                    cell_tris[fill[y * grid_w + x]++] = i;
+        }
+
+        packBuckets();
+    }
+
+    // Copies the equations into cell_soa in bucket order
+    void packBuckets() {
+        if(!eqs) {
+            cell_soa.resize(0, 0);
+            return;
+        }
+
+        cell_soa.resize(cell_tris.size() + SIMD_WIDTH, NAN);
+        for(size_t i = 0; i < cell_tris.size(); ++i) {
+            cell_soa.set(i, eqs[cell_tris[i]]);
+        }
+    }
+
+};
+
+const GLfloat Terrain::colors[6][4] = {
+    {0.005, 0.2, 0.2, 1.0},
+    {0.05, 0.8, 0.5, 0.2},
+    {0.14, 0.3, 0.6, 0.3},
+    {0.4, 0.3, 0.8, 0.3},
+    {0.6, 0.5, 0.7, 0.5},
+    {1.0, 1.0, 1.0, 1.0},
+};
+
+// Default memory budget for the tiles of a TerrainSet, in megabytes
+#define TILE_BUDGET_MB (512)
+
+// One tile of a TerrainSet. terrain is empty while the tile is on disk.
+// bytes is what it took last time it was loaded, or its file size before.
+// drawn says whether it may have GL objects to free
+struct TerrainTile {
+    string file;
+    Point min;
+    Point max;
+    size_t bytes;
+    shared_ptr<Terrain> terrain;
+    unsigned long last_used;
+    bool queued;
+    bool loading;
+    bool failed;
+    bool drawn;
+
+    TerrainTile() : bytes(0), last_used(0), queued(false), loading(false),
+                    failed(false), drawn(false) {}
+};
+
+// A terrain in tiles on disk, either split up by Terrain::split() or made
+// separately, one .tri or .trib file per region. Tiles are paged in as
+// queries and the camera reach them and dropped least recently used first
+// to stay within the memory budget. A single file is treated as one tile
+// that stays loaded, read in the background and drawn in pieces as it
+// comes in
+class TerrainSet {
+private:
+    vector<TerrainTile> tiles;
+    Point max_coords;
+    Point min_coords;
+
+    // Cell c of a per_side x per_side grid over the whole terrain overlaps
+    // the bounding boxes of tiles cell_tiles[c], its own tile first
+    int per_side;
+    GLfloat cell_w;
+    GLfloat cell_h;
+    vector<vector<int> > cell_tiles;
+
+    bool compact;
+    string cache_dir;
+    GLfloat hm_step;
+    size_t budget;
+    size_t resident;
+    unsigned long ticks;
+
+    // lock guards the tiles' terrain, flags and use counts, resident and
+    // queue, which the loader thread works through in the background
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<int> queue;
+    std::thread loader;
+    bool stopping;
+
+    // Evicted tiles that have been drawn wait here for draw() to free them,
+    // since their buffers can only be deleted with the GL context current
+    vector<shared_ptr<Terrain> > retired;
+
+    // Until a single file has loaded, queries wait and draw() shows the
+    // pieces read so far, whose box is seen_min to seen_max. The tiles,
+    // grid and bounds above are only touched once ready is set
+    std::atomic<bool> ready;
+    vector<shared_ptr<Terrain> > pieces;
+    Point seen_min;
+    Point seen_max;
+
+public:
+    TerrainSet() : per_side(0), cell_w(0), cell_h(0), compact(false), hm_step(0),
+                   budget((size_t)TILE_BUDGET_MB << 20), resident(0), ticks(0),
+                   stopping(false), ready(true) {}
+
+    ~TerrainSet() {
+        stop();
+    }
+
+    // Opens a directory of tiles and leaves them on disk until needed, or
+    // starts loading a .tri or .trib file in the background. The directory
+    // is either one written by Terrain::split() or any set of .tri and
+    // .trib files
+    bool init(const char *path) {
+        struct stat st;
+        if(stat(path, &st) != 0) return false;
+        if(S_ISDIR(st.st_mode)) {
+            string base(path);
+            if(stat((base + "/" + TILE_INDEX).c_str(), &st) != 0) return init(listTiles(base));
+
+            reset();
+            if(!readIndex(path)) return false;
+            loader = std::thread(&TerrainSet::loadQueued, this);
+            return true;
+        }
+
+        // Only the start is checked here, so that a wrong file still fails
+        // before anything is shown
+        reset();
+        if(!Terrain::looksLoadable(path)) return false;
+        tiles.resize(1);
+        tiles[0].file = path;
+        tiles[0].loading = true;
+        seen_min = Point(FLT_MAX, FLT_MAX, FLT_MAX);
+        seen_max = Point(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        ready = false;
+        loader = std::thread(&TerrainSet::loadWhole, this);
+        return true;
+    }
+
+    // Opens the given tiles, reading only enough of each to know its box,
+    // and spreads a grid of about one cell per tile over them all
+    bool init(const vector<string> &files) {
+        reset();
+        if(files.empty()) return false;
+
+        min_coords = Point(FLT_MAX, FLT_MAX, FLT_MAX);
+        max_coords = Point(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        for(size_t k = 0; k < files.size(); ++k) {
+            TerrainTile tile;
+            tile.file = files[k];
+            if(!Terrain::readBounds(tile.file.c_str(), tile.min, tile.max)) {
+                cerr << "Could not read terrain tile " << tile.file << endl;
+                return false;
+            }
+
+            struct stat st;
+            if(stat(tile.file.c_str(), &st) == 0) tile.bytes = st.st_size;
+            tiles.push_back(tile);
 
-    vector<Site> solve() {
-        GLfloat min_from_here = FLT_MAX;
-        vector<Site> min_path_from_here;
-        for(int i = 0; i < left.size(); i++ ) {
-            Site &removed = left[i];
-            left.erase(left.begin()+i);
-            vector<Site> possible_path;
-            GLfloat from_here = solve_r(removed, possible_path);
+            min_coords = Point(MIN(min_coords.x, tile.min.x), MIN(min_coords.y, tile.min.y),
+                               MIN(min_coords.z, tile.min.z));
+            max_coords = Point(MAX(max_coords.x, tile.max.x), MAX(max_coords.y, tile.max.y),
+                               MAX(max_coords.z, tile.max.z));
+        }
 
-            if(from_here < min_from_here) {
-                min_from_here = from_here;
-                possible_path.insert(possible_path.begin(), removed);
-                min_path_from_here = possible_path;
-            }
+        per_side = MAX(1, (int)ceil(sqrt((double)tiles.size())));
+        cell_w = MAX(max_coords.x - min_coords.x, FLT_MIN) / per_side;
+        cell_h = MAX(max_coords.y - min_coords.y, FLT_MIN) / per_side;
+        cell_tiles.assign(per_side * per_side, vector<int>());
+        for(size_t k = 0; k < tiles.size(); ++k) {
+            place(k, -1);
+        }
+
+        loader = std::thread(&TerrainSet::loadQueued, this);
+        return true;
+    }
+
+    // Applies to tiles loaded from now on
+    void setCompact(bool c) {
+        compact = c;
+    }
+
+    void setCacheDir(const string &dir) {
+        cache_dir = dir;
+    }
+
+    const string &cacheDir() {
+        return cache_dir;
+    }
 
-            left.insert(left.begin()+i, removed);
+    // Hash of every tile's name, size and modification time. Tells things
+    // cached from queries on the terrain apart when it changes, without
+    // reading every tile back in to hash its contents
+    uint64_t identity() {
+        uint64_t key = hashBytes(NULL, 0);
+        for(size_t k = 0; k < tiles.size(); ++k) {
+            struct stat st;
+            uint64_t stamp[2] = { 0, 0 };
+            if(stat(tiles[k].file.c_str(), &st) == 0) {
+                stamp[0] = st.st_size;
+                stamp[1] = st.st_mtime;
+            }
+            key = hashBytes(tiles[k].file.data(), tiles[k].file.size(), key);
+            key = hashBytes(stamp, sizeof(stamp), key);
         }
+        return key;
+    }
 
-        return min_path_from_here;
+    void setBudget(size_t bytes) {
+        std::lock_guard<std::mutex> guard(lock);
+        budget = bytes;
     }
 
-private:
-    GLfloat solve_r(Site &prev, vector<Site> &s) {
-        if(left.size() == 1) {
-            s = vector<Site>();
-            s.push_back(left[0]);
-            return (left[0].p - prev.p).norm();
+    GLfloat height(Point &p) {
+        TerrainCursor cursor;
+        return height(p, cursor);
+    }
+
+    // The cursor also remembers the tile, so a run of nearby queries only
+    // looks up its tile once
+    GLfloat height(Point &p, TerrainCursor &cursor) {
+        return route(p.x, p.y, cursor, [&](Terrain &t, TerrainCursor &c) {
+            return t.height(p, c);
+        });
+    }
+
+    GLfloat heightWithin(Point &p, GLfloat tolerance) {
+        TerrainCursor cursor;
+        return route(p.x, p.y, cursor, [&](Terrain &t, TerrainCursor &) {
+            return t.heightWithin(p, tolerance);
+        });
+    }
+
+    // Batched height(). Each round asks every point still unanswered of
+    // the next tile that covers it, own tile first as route() does, and
+    // each tile asked is acquired once and given its points as one batch.
+    // Points a tile misses go on to their next tile in the next round
+    void heights(const Point *pts, size_t n, float *out) {
+        awaitReady();
+        vector<size_t> tried(n, 0);
+        vector<size_t> pending(n);
+        for(size_t i = 0; i < n; ++i) {
+            out[i] = FLT_MAX;
+            pending[i] = i;
         }
 
-        GLfloat min_from_here = FLT_MAX;
-        vector<Site> min_path_from_here;
-        Site choosen;
-        for(int i = 0; i < left.size(); i++ ) {
-            Site &removed = left[i];
-            left.erase(left.begin()+i);
-            vector<Site> possible_path;
-            GLfloat from_here = solve_r(removed, possible_path);
-            if(from_here < min_from_here) {
-                choosen = removed;
-                min_from_here = from_here;
-                min_path_from_here = possible_path;
+        vector<pair<int, size_t> > asks;
+        vector<Point> batch;
+        vector<float> found;
+        while(!pending.empty()) {
+            asks.clear();
+            for(size_t k = 0; k < pending.size(); ++k) {
+                size_t i = pending[k];
+                const vector<int> *ids = cover(pts[i].x, pts[i].y);
+                if(!ids) continue;
+                while(tried[i] < ids->size() && !covers((*ids)[tried[i]], pts[i].x, pts[i].y)) {
+                    tried[i]++;
+                }
+                if(tried[i] < ids->size()) asks.push_back(make_pair((*ids)[tried[i]++], i));
+            }
+            sort(asks.begin(), asks.end());
+
+            pending.clear();
+            for(size_t a = 0, b = 0; a < asks.size(); a = b) {
+                int id = asks[a].first;
+                batch.clear();
+                for(b = a; b < asks.size() && asks[b].first == id; ++b) {
+                    batch.push_back(pts[asks[b].second]);
+                }
+
+                found.assign(batch.size(), FLT_MAX);
+                shared_ptr<Terrain> t = acquire(id);
+                if(t) t->heights(batch.data(), batch.size(), found.data());
+                for(size_t k = a; k < b; ++k) {
+                    if(found[k-a] != FLT_MAX) out[asks[k].second] = found[k-a];
+                    else pending.push_back(asks[k].second);
+                }
             }
+        }
+    }
 
-            left.insert(left.begin()+i, removed);
+    // Builds the heightmap of every loaded tile and of each one loaded later
+    void buildHeightmap(GLfloat step) {
+        awaitReady();
+        hm_step = step;
+        for(size_t k = 0; k < tiles.size(); ++k) {
+            shared_ptr<Terrain> t;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                t = tiles[k].terrain;
+            }
+            if(!t) continue;
+
+            t->buildHeightmap(step);
+            std::lock_guard<std::mutex> guard(lock);
+            if(tiles[k].terrain == t) {
+                resident -= tiles[k].bytes;
+                tiles[k].bytes = t->memoryUsage();
+                resident += tiles[k].bytes;
+            }
         }
+    }
 
-        GLfloat this_link = (prev.p - s[0].p).norm();
-        s = min_path_from_here;
-        s.insert(s.begin(), choosen);
-        return this_link + min_from_here;
+    GLfloat heightApprox(GLfloat x, GLfloat y) {
+        TerrainCursor cursor;
+        return route(x, y, cursor, [&](Terrain &t, TerrainCursor &) {
+            return t.heightApprox(x, y);
+        });
     }
 
-    vector<Site> left;
-};
+    // A point off a tile clears it, so p has to clear every tile it might
+    // be over
+    bool clears(Point &p, GLfloat margin) {
+        awaitReady();
+        const vector<int> *ids = cover(p.x, p.y);
+        for(size_t k = 0; ids && k < ids->size(); ++k) {
+            int id = (*ids)[k];
+            if(!covers(id, p.x, p.y)) continue;
+
+            shared_ptr<Terrain> t = acquire(id);
+            if(t && !t->clears(p, margin)) return false;
+        }
+        return true;
+    }
 
+    // Tries the tiles whose boxes the ray enters in order, stopping once a
+    // hit is nearer than the next box
+    GLfloat raycast(const Point &origin, const Vector &dir) {
+        awaitReady();
+        Vector inv(1 / dir.x, 1 / dir.y, 1 / dir.z);
+        vector<pair<GLfloat, int> > crossed;
+        for(size_t k = 0; k < tiles.size(); ++k) {
+            GLfloat t = rayBox(tiles[k].min, tiles[k].max, origin, inv, 0, FLT_MAX);
+            if(t != FLT_MAX) crossed.push_back(make_pair(t, (int)k));
+        }
+        sort(crossed.begin(), crossed.end());
 
-struct Triangle {
-    GLfloat vs[0];
-    Point v1;
-    Point v2;
-    Point v3;
-       
-    GLfloat maxX() {
-        return MAX(MAX(v1.x, v2.x), v3.x);
+        GLfloat best = FLT_MAX;
+        for(size_t i = 0; i < crossed.size() && crossed[i].first < best; ++i) {
+            shared_ptr<Terrain> t = acquire(crossed[i].second);
+            if(t) best = MIN(best, t->raycast(origin, dir));
+        }
+        return best;
     }
 
-    GLfloat minX() {
-        return MIN(MIN(v1.x, v2.x), v3.x);
-    }
+    bool lineOfSight(const Point &a, const Point &b) {
+        awaitReady();
+        Vector dir = b - a;
+        Vector inv(1 / dir.x, 1 / dir.y, 1 / dir.z);
+        for(size_t k = 0; k < tiles.size(); ++k) {
+            if(rayBox(tiles[k].min, tiles[k].max, a, inv, 0, 1) == FLT_MAX) continue;
 
-    GLfloat maxY() {
-        return MAX(MAX(v1.y, v2.y), v3.y);
+            shared_ptr<Terrain> t = acquire(k);
+            if(t && !t->lineOfSight(a, b)) return false;
+        }
+        return true;
     }
 
-    GLfloat minY() {
-        return MIN(MIN(v1.y, v2.y), v3.y);
+    // Lowest height of the curve over any tile, asking each only about the
+    // stretches of t where the curve is over its bounding box
+    GLfloat clearance(const Point &p0, const Point &p1, const Point &p2,
+                      GLfloat t0, GLfloat t1, TerrainCursor &cursor) {
+        awaitReady();
+        double A[2] = { p0.x - 2*p1.x + p2.x, p0.y - 2*p1.y + p2.y };
+        double B[2] = { 2*(p1.x - p0.x), 2*(p1.y - p0.y) };
+        double C[2] = { p0.x, p0.y };
+
+        GLfloat best = FLT_MAX;
+        for(size_t k = 0; k < tiles.size(); ++k) {
+            TerrainTile &tile = tiles[k];
+            GLfloat lo[2] = { tile.min.x, tile.min.y };
+            GLfloat hi[2] = { tile.max.x, tile.max.y };
+
+            // Where the curve crosses the lines along the box's sides
+            vector<double> cuts(1, t0);
+            for(int a = 0; a < 2; ++a) {
+                for(int side = 0; side < 2; ++side) {
+                    double q[3] = { A[a], B[a], C[a] - (side ? hi[a] : lo[a]) };
+                    double roots[2];
+                    int n = quadraticRoots(q, roots);
+                    for(int i = 0; i < n; ++i) {
+                        if(roots[i] > t0 && roots[i] < t1) cuts.push_back(roots[i]);
+                    }
+                }
+            }
+            cuts.push_back(t1);
+            sort(cuts.begin(), cuts.end());
+
+            TerrainCursor local;
+            TerrainCursor &c = cursor.tile == (int)k ? cursor : local;
+            shared_ptr<Terrain> t;
+            for(size_t i = 0; i + 1 < cuts.size(); ++i) {
+                double m = (cuts[i] + cuts[i+1]) / 2;
+                double x = C[0] + m*(B[0] + m*A[0]);
+                double y = C[1] + m*(B[1] + m*A[1]);
+                if(x < lo[0] || x > hi[0] || y < lo[1] || y > hi[1]) continue;
+
+                if(!t && !(t = acquire(k))) break;
+                GLfloat h = t->clearance(p0, p1, p2, cuts[i], cuts[i+1], c);
+                if(h < best) {
+                    best = h;
+                    cursor.tile = k;
+                    cursor.tri = c.tri;
+                }
+            }
+        }
+        return best;
     }
-        
-    GLfloat maxZ() {
-        return MAX(MAX(v1.z, v2.z), v3.z);
+
+    // Queues the tiles under p to be loaded in the background
+    void prefetch(const Point &p) {
+        if(!ready) return;
+        const vector<int> *ids = cover(p.x, p.y);
+        std::lock_guard<std::mutex> guard(lock);
+        for(size_t k = 0; ids && k < ids->size(); ++k) {
+            if(covers((*ids)[k], p.x, p.y)) enqueue((*ids)[k]);
+        }
     }
 
-    GLfloat minZ() {
-        return MIN(MIN(v1.z, v2.z), v3.z);
+    // Whether queries can be answered without waiting for the terrain to
+    // finish loading. Tiles may still have to be paged in
+    bool isReady() {
+        return ready;
     }
 
-    bool sameSide (Point p1, Point p2, Point a, Point b) {
-        Vector cp1 = cross(b-a, p1-a);
-        Vector cp2 = cross(b-a, p2-a);
-        if(dot(cp1, cp2) >= 0)
-           return true;
+    // Whether tiles are still on their way in
+    bool loading() {
+        std::lock_guard<std::mutex> guard(lock);
+        if(!ready || !queue.empty()) return true;
+        for(size_t k = 0; k < tiles.size(); ++k) {
+            if(tiles[k].loading) return true;
+        }
         return false;
     }
 
-    bool inside(Point p) {
-        Point a,b,c;
-        a = v1;
-        b = v2;
-        c = v3;
-        p.z = 0;
-        a.z = 0;
-        b.z = 0;
-        c.z = 0;
-        if(sameSide(p,a, b,c) && sameSide(p,b, a,c) && sameSide(p,c, a,b)) 
-            return true;
-        return false;
+    // Draws the visible tiles that are loaded, nearest first, and queues the
+    // nearest of the rest for as much as the budget allows
+    void draw(const Frustum &frustum, const Point &eye, GLfloat pixel_scale) {
+        if(!ready) {
+            drawPieces(frustum, eye, pixel_scale);
+            return;
+        }
+
+        vector<pair<GLfloat, int> > visible;
+        for(size_t k = 0; k < tiles.size(); ++k) {
+            TerrainTile &tile = tiles[k];
+            if(!frustum.intersects(tile.min, tile.max)) continue;
+
+            GLfloat dx = MAX(MAX(tile.min.x - eye.x, eye.x - tile.max.x), 0.0f);
+            GLfloat dy = MAX(MAX(tile.min.y - eye.y, eye.y - tile.max.y), 0.0f);
+            GLfloat dz = MAX(MAX(tile.min.z - eye.z, eye.z - tile.max.z), 0.0f);
+            visible.push_back(make_pair(dx*dx + dy*dy + dz*dz, (int)k));
+        }
+        sort(visible.begin(), visible.end());
+
+        vector<shared_ptr<Terrain> > drawing;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            retired.clear();
+
+            unsigned long now = ++ticks;
+            size_t planned = 0;
+            for(size_t i = 0; i < visible.size(); ++i) {
+                TerrainTile &tile = tiles[visible[i].second];
+                planned += tile.bytes;
+                if(tile.terrain) {
+                    tile.last_used = now;
+                    tile.drawn = true;
+                    drawing.push_back(tile.terrain);
+                } else if(planned <= budget) {
+                    enqueue(visible[i].second);
+                }
+            }
+        }
+
+        for(size_t i = 0; i < drawing.size(); ++i) {
+            drawing[i]->draw(frustum, eye, pixel_scale);
+        }
     }
 
-    Point findBarycentric(Point &p) {
-        Vector weights, location;
-        Point zero;
-        GLfloat detA = (v1.x*v2.y)-(v1.x*v3.y)-(v2.x*v1.y)+(v2.x*v3.y)+(v3.x*v1.y)-(v3.x*v2.y);
-        weights.x = ((p.x*v2.y)-(p.x*v3.y)-(v2.x*p.y)+(v2.x*v3.y)+(v3.x*p.y)-(v3.x*v2.y))/detA;
-        weights.y = ((v1.x*p.y)-(v1.x*v3.y)-(p.x*v1.y)+(p.x*v3.y)+(v3.x*v1.y)-(v3.x*p.y))/detA;
-        weights.z = ((v1.x*v2.y)-(v1.x*p.y)-(v2.x*v1.y)+(v2.x*p.y)+(p.x*v1.y)-(p.x*v2.y))/detA;
-        location = (weights.x*v1)+(weights.y*v2)+(weights.z*v3); 
-        return (zero+location);
+    // The box around as much of the terrain as has been read
+    Point getMaxCoords() {
+        if(ready) return max_coords;
+        std::lock_guard<std::mutex> guard(lock);
+        return ready ? max_coords : seen_max;
+    }
+
+    Point getMinCoords() {
+        if(ready) return min_coords;
+        std::lock_guard<std::mutex> guard(lock);
+        return ready ? min_coords : seen_min;
     }
-    
-};
 
-class Terrain {
 private:
-    int n_triangles;
-    int n_sites;
-    Point max_coords;
-    Point min_coords;
-    Triangle *triangles;
-    GLuint texture;
 
-public:
-    Terrain() : n_triangles(0), triangles(NULL) {}
+    void reset() {
+        stop();
+        tiles.clear();
+        cell_tiles.clear();
+        queue.clear();
+        retired.clear();
+        pieces.clear();
+        resident = 0;
+        per_side = 0;
+        ready = true;
+    }
 
-    bool init(char *file) {
+    // The .tri and .trib files in dir, in name order
+    static vector<string> listTiles(const string &dir) {
+        vector<string> files;
+        DIR *d = opendir(dir.c_str());
+        if(!d) return files;
 
-        // Free any existing state from a previous initialization
-        if(triangles) free(triangles);
-        std::ifstream in;
-        in.open(file);
+        while(struct dirent *entry = readdir(d)) {
+            string name = entry->d_name;
+            size_t dot = name.rfind('.');
+            if(dot == string::npos) continue;
 
-        // The total number of triangles will be the on the first line of the file
-        in >> n_triangles;
-        triangles = (Triangle*)malloc(sizeof(Triangle) * n_triangles);
+            string ext = name.substr(dot);
+            if(ext == ".tri" || ext == ".trib") files.push_back(dir + "/" + name);
+        }
+        closedir(d);
+        sort(files.begin(), files.end());
+        return files;
+    }
+
+    void awaitReady() {
+        if(ready) return;
+        std::unique_lock<std::mutex> guard(lock);
+        while(!ready) changed.wait(guard);
+    }
 
-        for(int i = 0; i < n_triangles && in.good(); ++i) {
-            in >> triangles[i].v1.x >> triangles[i].v1.y >> triangles[i].v1.z;
-            in >> triangles[i].v2.x >> triangles[i].v2.y >> triangles[i].v2.z;
-            in >> triangles[i].v3.x >> triangles[i].v3.y >> triangles[i].v3.z;
+    // The pieces read so far, shaded over the elevations seen so far
+    void drawPieces(const Frustum &frustum, const Point &eye, GLfloat pixel_scale) {
+        vector<shared_ptr<Terrain> > drawing;
+        GLfloat lo, hi;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            retired.clear();
+            drawing = pieces;
+            lo = seen_min.z;
+            hi = seen_max.z;
         }
 
-        if(in.fail()) {
-            return false;
+        for(size_t i = 0; i < drawing.size(); ++i) {
+            drawing[i]->setColorRange(lo, hi);
+            drawing[i]->draw(frustum, eye, pixel_scale);
         }
+    }
 
-        // Now compute the max and min elevations which we'll need for our terrain shading
-        max_coords.x = INT_MIN;
-        max_coords.y = INT_MIN;
-        max_coords.z = INT_MIN;
-        min_coords.x = INT_MAX;
-        min_coords.y = INT_MAX;
-        min_coords.z = INT_MAX;
+    void stop() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+            changed.notify_all();
+        }
+        if(loader.joinable()) loader.join();
+        stopping = false;
+    }
 
-        for(int i = 0; i < n_triangles; ++i) {
-            if(triangles[i].maxX() > max_coords.x)
-              max_coords.x = triangles[i].maxX();
-            if(triangles[i].minX() < min_coords.x)
-                min_coords.x = triangles[i].minX();
-            if(triangles[i].maxY() > max_coords.y)
-                max_coords.y = triangles[i].maxY();
-            if(triangles[i].minY() < min_coords.y)
-                min_coords.y = triangles[i].minY();
-            if(triangles[i].maxZ() > max_coords.z)
-                max_coords.z = triangles[i].maxZ();
-            if(triangles[i].minZ() < min_coords.z)
-                min_coords.z = triangles[i].minZ();
-	    }
-
-        Point minCoords = getMinCoords();
-        Point maxCoords = getMaxCoords();
-        
+    bool readIndex(const char *dir) {
+        string base(dir);
+        std::ifstream in((base + "/" + TILE_INDEX).c_str());
+        in >> per_side;
+        in >> min_coords.x >> min_coords.y >> min_coords.z;
+        in >> max_coords.x >> max_coords.y >> max_coords.z;
+        if(in.fail() || per_side <= 0) return false;
+
+        cell_w = MAX(max_coords.x - min_coords.x, FLT_MIN) / per_side;
+        cell_h = MAX(max_coords.y - min_coords.y, FLT_MIN) / per_side;
+        cell_tiles.assign(per_side * per_side, vector<int>());
+        for(int c = 0; c < per_side * per_side; ++c) {
+            string name;
+            in >> name;
+            if(in.fail()) return false;
+            if(name == "-") continue;
+
+            TerrainTile tile;
+            tile.file = base + "/" + name;
+            in >> tile.min.x >> tile.min.y >> tile.min.z;
+            in >> tile.max.x >> tile.max.y >> tile.max.z;
+            if(in.fail()) return false;
+
+            struct stat st;
+            if(stat(tile.file.c_str(), &st) == 0) tile.bytes = st.st_size;
+
+            // Triangles stick out of the cell they were assigned to
+            tiles.push_back(tile);
+            place(tiles.size() - 1, c);
+        }
         return true;
     }
 
-    GLfloat height(Point &p) {
-        for(int i = 0; i < n_triangles; i++) {
-            if(triangles[i].inside(p)) {
-                Point pos = triangles[i].findBarycentric(p);
-                return p.z - pos.z;
-            }               
-        } 
-
-        return FLT_MAX; 
+    // Makes the tile a candidate in every cell its bounding box reaches,
+    // and the first one asked in cell home
+    void place(int id, int home) {
+        TerrainTile &tile = tiles[id];
+        for(int j = cellY(tile.min.y); j <= cellY(tile.max.y); ++j) {
+            for(int i = cellX(tile.min.x); i <= cellX(tile.max.x); ++i) {
+                vector<int> &ids = cell_tiles[j * per_side + i];
+                if(j * per_side + i == home) ids.insert(ids.begin(), id);
+                else ids.push_back(id);
+            }
+        }
     }
 
-    void draw() {
+    int cellX(GLfloat x) {
+        return MAX(0, MIN((int)((x - min_coords.x) / cell_w), per_side-1));
+    }
 
-        glPushMatrix();
-        glBegin(GL_TRIANGLES);
-        for(int i = 0; i < n_triangles; ++i) {
-            GLfloat elevation = AVG(triangles[i].maxZ(), triangles[i].minZ());
-            setElevationColor(elevation);
+    int cellY(GLfloat y) {
+        return MAX(0, MIN((int)((y - min_coords.y) / cell_h), per_side-1));
+    }
 
-            glVertex3fv((GLfloat *)&triangles[i].v1.vs);
-            glVertex3fv((GLfloat *)&triangles[i].v2.vs);
-            glVertex3fv((GLfloat *)&triangles[i].v3.vs);
+    // Tiles that might hold (x, y), or NULL off the terrain
+    const vector<int> *cover(GLfloat x, GLfloat y) {
+        if(per_side == 0 || x < min_coords.x || x > max_coords.x ||
+                y < min_coords.y || y > max_coords.y) {
+            return NULL;
         }
-        glEnd();
-        glPopMatrix();
+        return &cell_tiles[cellY(y) * per_side + cellX(x)];
     }
 
-    
-    void setElevationColor(GLfloat elevation) {
-        GLfloat relative_height = (elevation - min_coords.z) / (max_coords.z - min_coords.z);
-        if(relative_height < colors[0][0]) {
-            glColor3fv(colors[0]+1);
-        } else if(relative_height < colors[1][0]) {
-            setColor(1, relative_height);
-        } else if(relative_height < colors[2][0]) {
-            setColor(2, relative_height);
-        } else if(relative_height < colors[3][0]) {
-            setColor(3, relative_height);
-        } else if(relative_height < colors[4][0]) {
-            setColor(4, relative_height);
-        } else {
-            glColor3fv(colors[5]+1);
+    bool covers(int id, GLfloat x, GLfloat y) {
+        TerrainTile &tile = tiles[id];
+        return x >= tile.min.x && x <= tile.max.x && y >= tile.min.y && y <= tile.max.y;
+    }
+
+    // Asks each tile that might hold (x, y), starting with the cursor's,
+    // until one answers something other than FLT_MAX
+    template <class F>
+    GLfloat route(GLfloat x, GLfloat y, TerrainCursor &cursor, F query) {
+        awaitReady();
+        if(cursor.tile >= 0 && covers(cursor.tile, x, y)) {
+            shared_ptr<Terrain> t = acquire(cursor.tile);
+            GLfloat h = t ? query(*t, cursor) : FLT_MAX;
+            if(h != FLT_MAX) return h;
+        }
+
+        const vector<int> *ids = cover(x, y);
+        for(size_t k = 0; ids && k < ids->size(); ++k) {
+            int id = (*ids)[k];
+            if(id == cursor.tile || !covers(id, x, y)) continue;
+
+            shared_ptr<Terrain> t = acquire(id);
+            if(!t) continue;
+
+            TerrainCursor local;
+            GLfloat h = query(*t, local);
+            if(h != FLT_MAX) {
+                cursor = local;
+                cursor.tile = id;
+                return h;
+            }
         }
+        return FLT_MAX;
     }
 
-    void setColor(int i, GLfloat relative_height) {
-        GLfloat s = (relative_height-colors[i-1][0]) / (colors[i][0] - colors[i-1][0]);
-        glColor3f(lerp(colors[i][1],colors[i+1][1],s),
-                  lerp(colors[i][2],colors[i+1][2],s),
-                  lerp(colors[i][3],colors[i+1][3],s)
-        );
+    // The tile, loaded right away if a query needs it before the loader
+    // thread has got to it
+    shared_ptr<Terrain> acquire(int id) {
+        std::unique_lock<std::mutex> guard(lock);
+        TerrainTile &tile = tiles[id];
+        while(tile.loading) changed.wait(guard);
+
+        if(!tile.terrain && !tile.failed) {
+            tile.loading = true;
+            guard.unlock();
+            shared_ptr<Terrain> t = loadTile(tile.file);
+            guard.lock();
+            install(id, t);
+        }
+        tile.last_used = ++ticks;
+        return tile.terrain;
     }
 
-    Triangle* getTriangles(){
-        return triangles;
+    void loadQueued() {
+        std::unique_lock<std::mutex> guard(lock);
+        while(true) {
+            while(queue.empty() && !stopping) changed.wait(guard);
+            if(stopping) return;
+
+            int id = queue.front();
+            queue.pop_front();
+            TerrainTile &tile = tiles[id];
+            tile.queued = false;
+            if(tile.terrain || tile.loading || tile.failed) continue;
+
+            tile.loading = true;
+            guard.unlock();
+            shared_ptr<Terrain> t = loadTile(tile.file);
+            guard.lock();
+            install(id, t);
+        }
     }
 
-    int numTriangles() {
-        return n_triangles;
+    // Reads the single file, handing out each batch of triangles as a piece
+    // to draw while the rest are read and indexed, then puts the whole
+    // terrain in their place
+    void loadWhole() {
+        shared_ptr<Terrain> t = loadTile(tiles[0].file, [this](const Point *corners, int n) {
+            shared_ptr<Terrain> piece(new Terrain());
+            piece->preview(corners, n);
+            Point lo = piece->getMinCoords();
+            Point hi = piece->getMaxCoords();
+
+            std::lock_guard<std::mutex> guard(lock);
+            pieces.push_back(piece);
+            seen_min = Point(MIN(seen_min.x, lo.x), MIN(seen_min.y, lo.y), MIN(seen_min.z, lo.z));
+            seen_max = Point(MAX(seen_max.x, hi.x), MAX(seen_max.y, hi.y), MAX(seen_max.z, hi.z));
+        });
+
+        std::lock_guard<std::mutex> guard(lock);
+        if(t) {
+            min_coords = tiles[0].min = t->getMinCoords();
+            max_coords = tiles[0].max = t->getMaxCoords();
+            t->setColorRange(min_coords.z, max_coords.z);
+            per_side = 1;
+            cell_w = MAX(max_coords.x - min_coords.x, FLT_MIN);
+            cell_h = MAX(max_coords.y - min_coords.y, FLT_MIN);
+            cell_tiles.assign(1, vector<int>(1, 0));
+        }
+
+        // Pieces may have buffers, which only draw() can free
+        retired.insert(retired.end(), pieces.begin(), pieces.end());
+        pieces.clear();
+        install(0, t);
+        ready = true;
     }
-    Point getMaxCoords() {
-        return max_coords;
+
+    shared_ptr<Terrain> loadTile(const string &file, Terrain::ParseCallback parsed = nullptr) {
+        shared_ptr<Terrain> t(new Terrain());
+        t->setCompact(compact);
+        t->setCacheDir(cache_dir);
+        if(!t->init(file.c_str(), parsed)) {
+            cerr << "Could not load terrain tile " << file << endl;
+            return shared_ptr<Terrain>();
+        }
+        t->setColorRange(min_coords.z, max_coords.z);
+        if(hm_step > 0) t->buildHeightmap(hm_step);
+        return t;
     }
-  
-    Point getMinCoords() {
-        return min_coords; 
+
+    // Called with lock held
+    void enqueue(int id) {
+        TerrainTile &tile = tiles[id];
+        if(tile.terrain || tile.queued || tile.loading || tile.failed) return;
+
+        tile.queued = true;
+        queue.push_back(id);
+        changed.notify_all();
     }
 
-    static const GLfloat colors[6][4];
+    // Called with lock held. Makes room for the new tile by retiring the
+    // least recently used others
+    void install(int id, shared_ptr<Terrain> t) {
+        TerrainTile &tile = tiles[id];
+        tile.loading = false;
+        changed.notify_all();
+        if(!t) {
+            tile.failed = true;
+            return;
+        }
 
-};
+        tile.terrain = t;
+        tile.bytes = t->memoryUsage();
+        tile.last_used = ++ticks;
+        resident += tile.bytes;
 
-const GLfloat Terrain::colors[6][4] = {
-    {0.005, 0.2, 0.2, 1.0},
-    {0.05, 0.8, 0.5, 0.2},
-    {0.14, 0.3, 0.6, 0.3},
-    {0.4, 0.3, 0.8, 0.3},
-    {0.6, 0.5, 0.7, 0.5},
-    {1.0, 1.0, 1.0, 1.0},
+        while(resident > budget) {
+            int lru = -1;
+            for(size_t k = 0; k < tiles.size(); ++k) {
+                if(!tiles[k].terrain || (int)k == id) continue;
+                if(lru < 0 || tiles[k].last_used < tiles[lru].last_used) lru = k;
+            }
+            if(lru < 0) break;
+
+            if(tiles[lru].drawn) retired.push_back(tiles[lru].terrain);
+            tiles[lru].terrain.reset();
+            tiles[lru].drawn = false;
+            resident -= tiles[lru].bytes;
+        }
+    }
 };
 
-Terrain terrain;
+TerrainSet terrain;
 
 
 class Parabola {
@@ -493,31 +4790,42 @@ public:
         return max_curvature;
     }
 
+    // Angle in radians the curve turns through. A parabola's tangent only
+    // ever swings one way, so that is the angle between its end tangents
+    GLfloat turning() {
+        Vector a = ddt(0);
+        Vector b = ddt(1);
+        double na = a.norm(), nb = b.norm();
+        if(na == 0 || nb == 0) return 0;
+        return acos(MAX(-1.0, MIN(1.0, dot(a, b) / (na * nb))));
+    }
+
     GLfloat minHeight() {
-        GLfloat minHeight = INT_MAX;
-        Point zero;
-        int count = 0;
-        for(GLfloat t = 0.1; t < 1.0; t += 0.1) {
-            count = 0;
-            Point cur = evaluate(t);
-            GLfloat height = terrain.height(cur);
-            minHeight = MIN(minHeight, height);
-        }
-        return minHeight;
+        TerrainCursor cursor;
+        return minHeight(cursor);
+    }
+
+    // Exact lowest height over the terrain. Consecutive curves pick up
+    // where the last one left the cursor
+    GLfloat minHeight(TerrainCursor &cursor) {
+        return terrain.clearance(ctrlpts[0], ctrlpts[1], ctrlpts[2], 0, 1, cursor);
     }
 
 private:
 
+    // |fd x sd| / |fd|^3. cross() hands back a unit vector, so the size of
+    // the cross product comes from Lagrange's identity instead
     GLfloat curvature(GLfloat t) {
         Vector fd = ddt(t);
         Vector sd = d2dt2(t);
 
-        return cross(fd, sd).norm() / pow(fd.norm(), 3);
+        double f = fd.norm(), s = sd.norm(), d = dot(fd, sd);
+        return sqrt(MAX(f*f*s*s - d*d, 0)) / pow(f, 3);
     }
     
     // First derivative of this parabola
     Vector ddt(GLfloat t) {
-        return 2*(1-t)*(ctrlpts[1] - ctrlpts[0]) + 2*(ctrlpts[2] - ctrlpts[1]);
+        return 2*(1-t)*(ctrlpts[1] - ctrlpts[0]) + 2*t*(ctrlpts[2] - ctrlpts[1]);
     }
 
     // Second derivative of this parabola
@@ -545,6 +4853,13 @@ public:
         sites.push_back(s);
     }
 
+    // Starts over from just these sites, before optimize() adds its joints
+    void setSites(vector<Site> &s) {
+        list.clear();
+        controlPts.clear();
+        sites = s;
+    }
+
     void clearSplineFrom(int i) {
         list.erase(list.begin()+i, list.end());
     }
@@ -619,10 +4934,12 @@ public:
     }
     
     GLfloat minHeight() {
+        // Each curve starts where the last one ended, so keep walking
+        TerrainCursor cursor;
         GLfloat minHeight = FLT_MAX;
         for(vector<Parabola>::iterator iter = list.begin();
                 iter != list.end(); ++iter) {
-            minHeight = MIN(minHeight, iter->minHeight());
+            minHeight = MIN(minHeight, iter->minHeight(cursor));
         }
         return minHeight;
     }
@@ -688,6 +5005,87 @@ private:
     
 };
 
+// Length added to a leg's cost per radian its parabola turns through.
+// Turning has no units, unlike curvature, so no leg pays more than pi
+// times this however short it is. Over flat ground a leg turns through
+// 2*atan(2*SAFETY_FACTOR / length); at this weight legs shorter than the
+// arch is high all cost about the same, and longer ones more the longer
+// they are
+#define LEG_TURN_WEIGHT (SAFETY_FACTOR)
+
+// Length added to a leg's cost per unit it dips below height d over the
+// terrain. Both weights are part of the key legCosts() caches under
+#define LEG_CLEARANCE_WEIGHT (10)
+
+// Most sites legCosts() prices every pair of. The matrix takes n^2 floats
+// and each leg a walk over the terrain
+#define LEG_COSTS_MAX_SITES (2048)
+
+// What flying straight from a to b costs, both already raised by d: the
+// parabola that arches SAFETY_FACTOR over the midpoint between them, as
+// optimize() starts a tour, priced by its length, how far it turns and
+// how far it drops below d over the terrain
+GLfloat legCost(Point a, Point b, int d) {
+    if((b - a).norm() == 0) return 0;
+
+    Point mid = lerp(a, b, 0.5);
+    mid.z += SAFETY_FACTOR;
+    Parabola leg;
+    leg.setCtrlPoint(0, a);
+    leg.setCtrlPoint(1, mid);
+    leg.setCtrlPoint(2, b);
+    return leg.length() + LEG_TURN_WEIGHT * leg.turning() +
+           LEG_CLEARANCE_WEIGHT * MAX(0, d - leg.minHeight());
+}
+
+// legCost() of every pair of sites, as an n x n matrix for
+// Salesman::setCosts(), with the rows handed out over every core. With a
+// cache directory the matrix is kept in it keyed by the sites, the terrain,
+// d and the weights. Empty past LEG_COSTS_MAX_SITES
+vector<GLfloat> legCosts(const vector<Site> &sites, int d) {
+    int n = sites.size();
+    vector<GLfloat> costs;
+    if(n > LEG_COSTS_MAX_SITES) return costs;
+
+    vector<Point> points(n);
+    for(int i = 0; i < n; ++i) {
+        points[i] = sites[i].p;
+        points[i].z += d;
+    }
+
+    string file;
+    uint64_t key = 0;
+    if(!terrain.cacheDir().empty()) {
+        uint64_t params[] = { CACHE_VERSION, (uint64_t)d, LEG_TURN_WEIGHT,
+                              LEG_CLEARANCE_WEIGHT, SAFETY_FACTOR };
+        key = hashBytes(params, sizeof(params), terrain.identity());
+        key = hashBytes(points.data(), sizeof(Point) * n, key);
+        file = cacheFile(terrain.cacheDir(), key, "legs");
+
+        size_t size = 0;
+        void *base = mapCache(file, key, size);
+        if(base) {
+            CacheReader in(base, size, CacheReader::align(sizeof(CacheHeader)));
+            in.array(costs);
+            munmap(base, size);
+            if(in.ok && costs.size() == (size_t)n * n) return costs;
+            cerr << "Ignoring damaged leg cost cache " << file << endl;
+        }
+    }
+
+    costs.assign((size_t)n * n, 0);
+    parallelFor(n, [&](int i) {
+        for(int j = i + 1; j < n; ++j) {
+            costs[(size_t)i*n + j] = costs[(size_t)j*n + i] = legCost(points[i], points[j], d);
+        }
+    });
+
+    if(!file.empty() && !writeCacheFile(file, key, [&](CacheWriter &out) { out.array(costs); })) {
+        cerr << "Could not write leg cost cache " << file << endl;
+    }
+    return costs;
+}
+
 class Camera {
 private:
     Point pos;
@@ -720,6 +5118,53 @@ public:
         glLoadIdentity();
         glMultMatrixf(viewMat);
     }
+
+    // Where the eye really is. pos goes stale once rotate() has turned the
+    // world about the origin, so read it back out of the view matrix
+    Point eye() {
+        GLfloat *m = viewMat;
+        return Point(-(m[0]*m[12] + m[1]*m[13] + m[2]*m[14]),
+                     -(m[4]*m[12] + m[5]*m[13] + m[6]*m[14]),
+                     -(m[8]*m[12] + m[9]*m[13] + m[10]*m[14]));
+    }
+
+    // Height in pixels of something one unit tall one unit in front of the
+    // eye, which divided by distance gives its size on screen
+    GLfloat pixelScale() {
+        return window_height / (2 * tan(fov * M_PI / 360.0));
+    }
+
+    // Planes of the view volume, from the same perspective updateProj()
+    // sets up combined with the view matrix
+    Frustum frustum() {
+        GLfloat proj[16] = {0};
+        GLfloat f = 1.0 / tan(fov * M_PI / 360.0);
+        proj[0] = f / aspect_ratio;
+        proj[5] = f;
+        proj[10] = (far + close) / (close - far);
+        proj[11] = -1;
+        proj[14] = 2 * far * close / (close - far);
+
+        GLfloat clip[16];
+        for(int c = 0; c < 4; ++c) {
+            for(int r = 0; r < 4; ++r) {
+                clip[c*4+r] = 0;
+                for(int k = 0; k < 4; ++k)
+                    clip[c*4+r] += proj[k*4+r] * viewMat[c*4+k];
+            }
+        }
+
+        // Left, right, bottom, top, near and far are the last row of the clip
+        // matrix plus or minus each of the others
+        Frustum fr;
+        for(int i = 0; i < 3; ++i) {
+            for(int j = 0; j < 4; ++j) {
+                fr.planes[2*i][j] = clip[j*4+3] + clip[j*4+i];
+                fr.planes[2*i+1][j] = clip[j*4+3] - clip[j*4+i];
+            }
+        }
+        return fr;
+    }
     
     void moveTo(Point to) {
         move(to - pos);
@@ -746,11 +5191,13 @@ public:
         glPopMatrix();
     }
 
-    void rotate(GLfloat theta, GLfloat phi) {
+    // Turns the world about the point about
+    void rotate(GLfloat theta, GLfloat phi, Point about = Point()) {
         glMatrixMode(GL_MODELVIEW);
         glPushMatrix();
             glLoadIdentity();
             glMultMatrixf(viewMat);
+            glTranslatef(about.x, about.y, about.z);
 
             // Rotate look theta around the vertical axis through pos
             glRotatef(theta, 0, 0, 1.0);
@@ -758,10 +5205,24 @@ public:
             // Rotate look phi about the horizontal axis through pos and 
             glRotatef(phi, 1, 0, 0);
 
+            glTranslatef(-about.x, -about.y, -about.z);
             glGetFloatv(GL_MODELVIEW_MATRIX, viewMat);
         glPopMatrix();
     }
 
+    // Direction from the eye through window pixel (x, y), which GLUT counts
+    // from the top left. The view matrix's rotation takes world directions
+    // into eye space, so its transpose brings this one back out
+    Vector ray(int x, int y) {
+        GLfloat f = tan(fov * M_PI / 360.0);
+        GLfloat ex = (2.0 * x / window_width - 1) * f * aspect_ratio;
+        GLfloat ey = (1 - 2.0 * y / window_height) * f;
+        GLfloat *m = viewMat;
+        return Vector(m[0]*ex + m[1]*ey - m[2],
+                      m[4]*ex + m[5]*ey - m[6],
+                      m[8]*ex + m[9]*ey - m[10]);
+    }
+
     void reshape(int new_width, int new_height) {
         window_width = new_width;
         window_height = new_height;
@@ -791,9 +5252,10 @@ private:
      Spline spline;
      vector<Site> sites;
      int d;
+     bool hidden_pending;
 
 public:
-    Tour() {}
+    Tour() : hidden_pending(false) {}
 
     bool init(char* file) {
         std::ifstream in;
@@ -814,10 +5276,14 @@ public:
     void reorder() {
         // Gives us the freedom to reorder sites
         Salesman sales(sites);
+        vector<GLfloat> costs = legCosts(sites, d);
+        if(!costs.empty()) sales.setCosts(costs);
         sites = sales.solve();
 
+        spline.setSites(sites);
         spline.optimize(d);
         cout << "Reordered sites" << endl;
+        if(!sales.provenShortest()) cout << "Order is the best found in time, not proven shortest" << endl;
         printMetrics();
     }
 
@@ -832,7 +5298,16 @@ public:
     }
 
     GLfloat minHeight() {
-        spline.minHeight();
+        return spline.minHeight();
+    }
+
+    // Number of sites the terrain hides from the one before
+    int hiddenLegs() {
+        int hidden = 0;
+        for(size_t i = 1; i < sites.size(); ++i) {
+            if(!terrain.lineOfSight(sites[i-1].p, sites[i].p)) hidden++;
+        }
+        return hidden;
     }
 
     void printSites() {
@@ -846,12 +5321,30 @@ public:
         cout << "Parabolic curves: " << spline.numCurves() << endl;;
         cout << "Maximum curvature: " << spline.maxCurvature() << endl;;
         cout << "Length: " << spline.length() << endl;;
+
+        // Rather than hold up the first frame, wait for the terrain
+        if(terrain.isReady()) printHidden();
+        else hidden_pending = true;
         //cout << "Min height: " << minHeight() << endl;
     }
 
+    // Prints what printMetrics() left out, once the terrain has loaded
+    void printPending() {
+        if(hidden_pending && terrain.isReady()) printHidden();
+    }
+
+    void printHidden() {
+        cout << "Sites hidden from the last: " << hiddenLegs() << endl;
+        hidden_pending = false;
+    }
+
     Point getPoint(GLfloat t) {
         return spline.getPoint(t);
     }
+
+    int numCurves() {
+        return spline.numCurves();
+    }
 };
 
 Tour tour;
@@ -911,16 +5404,27 @@ struct {
 
 } animInfo;
 
+// While flying the tour, ask for the terrain under the next PREFETCH_POINTS
+// points PREFETCH_SPACING curves apart ahead of the camera
+#define PREFETCH_POINTS (8)
+#define PREFETCH_SPACING (0.25)
+
 void draw() {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     if(animInfo.active) {
-        camera.moveTo(tour.getPoint(animInfo.getTime()));
+        GLfloat t = animInfo.getTime();
+        camera.moveTo(tour.getPoint(t));
+        for(int i = 1; i <= PREFETCH_POINTS; ++i) {
+            GLfloat ahead = t + i * PREFETCH_SPACING;
+            if(ahead >= tour.numCurves()) break;
+            terrain.prefetch(tour.getPoint(ahead));
+        }
     }
 
     DefineLight();
     DefineMaterial();
     camera.draw();
-    terrain.draw();
+    terrain.draw(camera.frustum(), camera.eye(), camera.pixelScale());
     tour.draw();
     glutSwapBuffers();
 }
@@ -977,17 +5481,50 @@ struct {
     bool inRotateMode;
     int lastX;
     int lastY;
+    Point pivot;
 } mouseState;
 
+// Closest the wheel will zoom the camera to the ground
+#define CAMERA_CLEARANCE (100)
+
+// What the camera zooms or turns about: the terrain under the mouse, or
+// the origin if there is none. Sets dist to how far away it is
+Point pick(int x, int y, GLfloat &dist) {
+    Point eye = camera.eye();
+    Vector dir = camera.ray(x, y);
+    dir.normalize();
+    dist = terrain.raycast(eye, dir);
+    return dist == FLT_MAX ? Point() : eye + dir * dist;
+}
+
 void wheel(int button, int state, int x, int y) {
     if(button == 3 || button == 4) {
-        GLfloat dir = button == 3 ? -500 : 500;
-        camera.move(Vector(0,0, dir));
+        // Zoom towards whatever is under the mouse, or straight down
+        GLfloat step = button == 3 ? 500 : -500;
+        GLfloat dist;
+        Point target = pick(x, y, dist);
+        if(dist != FLT_MAX) {
+            if(step < 0 || dist - step >= CAMERA_CLEARANCE) {
+                Vector dir = target - camera.eye();
+                dir.normalize();
+                camera.move(dir * step);
+            }
+        } else {
+            Point to = camera.eye() + Vector(0,0, -step);
+            GLfloat ground = terrain.heightApprox(to.x, to.y);
+            if(step < 0 || ground == FLT_MAX || to.z - ground >= CAMERA_CLEARANCE) {
+                camera.move(Vector(0,0, -step));
+            }
+        }
         glutPostRedisplay();
     } else if(button == GLUT_MIDDLE_BUTTON) {
         mouseState.inRotateMode = !state;
         mouseState.lastX = x;
         mouseState.lastY = y;
+
+        // Turn about the terrain under the mouse
+        GLfloat dist;
+        if(!state) mouseState.pivot = pick(x, y, dist);
     }
 }
 
@@ -997,7 +5534,7 @@ void motion(int x, int y) {
         int diff_x = x - mouseState.lastX;
         int diff_y = y - mouseState.lastY;
 
-        camera.rotate(RAD_PER_UNIT * diff_x, RAD_PER_UNIT * -diff_y);
+        camera.rotate(RAD_PER_UNIT * diff_x, RAD_PER_UNIT * -diff_y, mouseState.pivot);
 
         mouseState.lastX = x;
         mouseState.lastY = y;
@@ -1007,9 +5544,11 @@ void motion(int x, int y) {
 }
 
 void animate(int value) { 
-    if(animInfo.active) {
+    // Keep redrawing while tiles stream in so they show up as they arrive
+    if(animInfo.active || terrain.loading()) {
         glutPostRedisplay();
     }
+    tour.printPending();
     glutTimerFunc(TIMERMSECS, animate, 0);
 }
 
@@ -1041,13 +5580,62 @@ void glInit(int *argc, char **argv) {
 }
 
 void usage() {
-    std::cout << "Usage ./tour d terrain_data.tri terrain_data.tour" << std::endl;
+    std::cout << "Usage ./tour [-q] [-m step] [-b megabytes] [-k cache_dir] d terrain terrain_data.tour" << std::endl;
+    std::cout << "      terrain is a .tri or .trib file, a tile_dir from -s or a" << std::endl;
+    std::cout << "      directory of .tri and .trib tiles" << std::endl;
+    std::cout << "      -q keeps the terrain in compact 16-bit form" << std::endl;
+    std::cout << "      -m rasterizes a heightmap with samples step apart" << std::endl;
+    std::cout << "      -b keeps at most megabytes of terrain tiles in memory" << std::endl;
+    std::cout << "      -k keeps what is built from each terrain file in cache_dir" << std::endl;
+    std::cout << "         and reuses it when the same file is loaded again" << std::endl;
+    std::cout << "      ./tour -c terrain_data.tri terrain_data.trib" << std::endl;
+    std::cout << "      ./tour -s terrain_data.tri tile_dir tiles_per_side" << std::endl;
     exit(1);
 }
 
 
 int main(int argc, char **argv) {
-    if(argc < 4 || !terrain.init(argv[2]) || !tour.init(argv[3])) usage();
+    if(argc == 4 && strcmp(argv[1], "-c") == 0) {
+        // Convert a .tri file to the binary format and quit
+        Terrain whole;
+        if(!whole.init(argv[2]) || !whole.save(argv[3])) usage();
+        return 0;
+    }
+
+    if(argc == 5 && strcmp(argv[1], "-s") == 0) {
+        // Split a terrain into tiles to be streamed and quit
+        Terrain whole;
+        int per_side = atoi(argv[4]);
+        if(per_side <= 0 || !whole.init(argv[2]) || !whole.split(argv[3], per_side)) usage();
+        return 0;
+    }
+
+    GLfloat heightmap_step = 0;
+    while(argc > 1 && argv[1][0] == '-') {
+        int used = 1;
+        if(strcmp(argv[1], "-q") == 0) {
+            terrain.setCompact(true);
+        } else if(strcmp(argv[1], "-m") == 0 && argc > 2) {
+            heightmap_step = atof(argv[2]);
+            used = 2;
+        } else if(strcmp(argv[1], "-b") == 0 && argc > 2) {
+            terrain.setBudget((size_t)atoi(argv[2]) << 20);
+            used = 2;
+        } else if(strcmp(argv[1], "-k") == 0 && argc > 2) {
+            terrain.setCacheDir(argv[2]);
+            used = 2;
+        } else {
+            usage();
+        }
+        argv[used] = argv[0];
+        argc -= used;
+        argv += used;
+    }
+
+    // The terrain loads in the background, building a heightmap if asked
+    if(argc < 4) usage();
+    if(heightmap_step > 0) terrain.buildHeightmap(heightmap_step);
+    if(!terrain.init(argv[2]) || !tour.init(argv[3])) usage();
     glInit(&argc, argv);
     tour.genTour(atoi(argv[1]));
     glutMainLoop();